@@ -25,16 +25,64 @@
  *
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(WSPMCE_TIMER_RDTSC)
+#if !defined(__x86_64__) && !defined(__i386__)
+#error WSPMCE_TIMER_RDTSC requires an x86 processor
+#endif
+#include <x86intrin.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 #include "zlib.h"
 
+// Number of messages timed by each pair of clock readings. Building with
+// -DWSPMCE_TIMING_BATCH=K reads the clock once per K messages and splits the
+// time between them in proportion to their size, which makes clock overhead
+// negligible for very small messages at the cost of per message precision.
+#ifndef WSPMCE_TIMING_BATCH
+#define WSPMCE_TIMING_BATCH 1
+#endif
+
 class pod_buffer {
 public:
     pod_buffer() : m_cursor(0), m_capacity(0) {}
@@ -52,6 +100,10 @@ public:
         return m_capacity;
     }
 
+    unsigned char * data() {
+        return m_buf.get();
+    }
+
     unsigned char * first_avail() {
         return m_buf.get()+m_cursor;
     }
@@ -70,296 +122,5112 @@ public:
     void adv_cursor(size_t cursor) {
         m_cursor += cursor;
     }
-private:
-    size_t m_cursor;
-    size_t m_capacity;
-    std::unique_ptr<unsigned char> m_buf;
-};
+private:
+    size_t m_cursor;
+    size_t m_capacity;
+    std::unique_ptr<unsigned char[]> m_buf;
+};
+
+// Binary corpus format, for messages that cannot be represented one per line:
+//
+// header: "WSMC", version (1 byte, currently 1), flags (1 byte)
+// then for each message:
+//   opcode (1 byte, 1 = text, 2 = binary)        if flags & corpus_flag_opcode
+//   timestamp delta in microseconds (varint)     if flags & corpus_flag_timestamp
+//   connection id (varint)                       if flags & corpus_flag_connection
+//   payload length (varint)
+//   payload
+//
+// varints are unsigned LEB128: 7 bits per byte, least significant first, with
+// the high bit set on all but the last byte.
+const char corpus_magic[4] = {'W', 'S', 'M', 'C'};
+const unsigned char corpus_version = 1;
+const unsigned char corpus_flag_opcode = 0x01;
+const unsigned char corpus_flag_timestamp = 0x02;
+const unsigned char corpus_flag_connection = 0x04;
+const unsigned char corpus_flags_known = corpus_flag_opcode | corpus_flag_timestamp 
+    | corpus_flag_connection;
+
+const unsigned char opcode_continuation = 0x0;
+const unsigned char opcode_text = 0x1;
+const unsigned char opcode_binary = 0x2;
+
+// Decode a varint starting at pos, advancing pos past it. Returns false if the
+// buffer ends first or the value does not fit in 64 bits.
+bool read_varint(char const * buf, size_t length, size_t & pos, uint64_t & value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= length) {
+            return false;
+        }
+        unsigned char b = static_cast<unsigned char>(buf[pos++]);
+        value |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void write_varint(std::ostream & out, uint64_t value) {
+    while (value >= 0x80) {
+        out.put(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.put(static_cast<char>(value));
+}
+
+// A file mapped read-only into memory, unmapped when this is destroyed
+class file_mapping {
+public:
+    file_mapping() : m_base(nullptr), m_length(0) {}
+
+    ~file_mapping() {
+        if (m_base) {
+            munmap(const_cast<char *>(m_base), m_length);
+        }
+    }
+
+    // Returns false and prints an error if the file cannot be mapped. An empty
+    // file maps to no data.
+    bool map(std::string const & path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cout << "Unable to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            std::cout << "Unable to stat " << path << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return false;
+        }
+
+        size_t length = size_t(st.st_size);
+        if (length > 0) {
+            void * map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                std::cout << "Unable to map " << path << ": " << strerror(errno) << std::endl;
+                close(fd);
+                return false;
+            }
+            madvise(map, length, MADV_WILLNEED);
+
+            m_base = static_cast<char const *>(map);
+            m_length = length;
+        }
+        close(fd);
+        return true;
+    }
+
+    char const * data() const {
+        return m_base;
+    }
+
+    size_t size() const {
+        return m_length;
+    }
+private:
+    file_mapping(file_mapping const &) = delete;
+    file_mapping & operator=(file_mapping const &) = delete;
+
+    char const * m_base;
+    size_t m_length;
+};
+
+// The full set of input messages. The input is read into memory, or mapped from
+// a file, once so that it can be shared read-only between any number of tests.
+// Input is either one message per line or the binary corpus format above, which
+// is detected by its header.
+class corpus {
+public:
+    corpus() : m_base(nullptr), m_length(0), m_end(0), m_connections(0),
+        m_source(nullptr), m_copies(0) {}
+
+    // A view of source in which each of its messages is sent once on each of
+    // copies connections in turn. Nothing is copied, so the view costs no
+    // memory however many copies there are. source must outlive the view.
+    corpus(corpus const & source, size_t copies) : m_base(nullptr), m_length(0), 
+        m_end(0), m_connections(copies), m_source(&source), m_copies(copies) {}
+
+    // Read messages until the end of the stream. If id_column is set each line
+    // starts with a connection id followed by a tab, which is not part of the
+    // message. Returns false and prints an error if the input is malformed.
+    bool load(std::istream & input, bool id_column) {
+        // read straight into m_data, sized up front if the stream can seek
+        m_data.clear();
+        std::streampos start = input.tellg();
+        if (start != std::streampos(-1) && input.seekg(0, std::ios::end)) {
+            std::streampos end = input.tellg();
+            if (end > start) {
+                m_data.reserve(size_t(end - start));
+            }
+            input.seekg(start);
+        }
+        input.clear();
+
+        char chunk[65536];
+        while (input.read(chunk, sizeof(chunk)) || input.gcount() > 0) {
+            m_data.append(chunk, size_t(input.gcount()));
+        }
+
+        m_base = m_data.data();
+        m_length = m_data.size();
+        return index(id_column);
+    }
+
+    // Map a file of messages into memory. Messages point straight into the
+    // mapping so nothing is copied. Returns false and prints an error if the
+    // file cannot be mapped or is malformed.
+    bool load_file(std::string const & path, bool id_column) {
+        if (!m_mapping.map(path)) {
+            return false;
+        }
+        m_base = m_mapping.data();
+        m_length = m_mapping.size();
+
+        // building the index touches every page, so no page faults are left to
+        // be taken inside the timed deflate calls
+        return index(id_column);
+    }
+
+    // Append a message to a corpus being built in memory, such as one
+    // recovered from a packet capture
+    void append(unsigned char const * data, size_t size, size_t connection, 
+        unsigned char opcode, uint64_t timestamp)
+    {
+        m_offsets.push_back(m_data.size());
+        m_sizes.push_back(size);
+        m_connection_ids.push_back(connection);
+        m_opcodes.push_back(opcode);
+        m_timestamps.push_back(timestamp);
+
+        m_data.append(reinterpret_cast<char const *>(data), size);
+        m_base = m_data.data();
+        m_length = m_data.size();
+        m_connections = std::max(m_connections, connection+1);
+    }
+
+    // Write the corpus in the binary corpus format
+    void write_binary(std::ostream & out) const {
+        unsigned char flags = corpus_flag_opcode;
+        if (m_connections > 0) {
+            flags |= corpus_flag_connection;
+        }
+        if (has_timestamps()) {
+            flags |= corpus_flag_timestamp;
+        }
+
+        out.write(corpus_magic, sizeof(corpus_magic));
+        out.put(static_cast<char>(corpus_version));
+        out.put(static_cast<char>(flags));
+
+        uint64_t last_timestamp = 0;
+        for (size_t i = 0; i < size(); i++) {
+            out.put(static_cast<char>(opcode(i)));
+            if (flags & corpus_flag_timestamp) {
+                write_varint(out, timestamp(i) - last_timestamp);
+                last_timestamp = timestamp(i);
+            }
+            if (flags & corpus_flag_connection) {
+                write_varint(out, connection(i));
+            }
+            write_varint(out, size(i));
+            out.write(reinterpret_cast<char const *>(data(i)), size(i));
+        }
+    }
+
+    size_t size() const {
+        return (m_source ? m_source->size()*m_copies : m_offsets.size());
+    }
+
+    // number of distinct connection ids in the input
+    size_t connections() const {
+        return m_connections;
+    }
+
+    // connection id of the message, or 0 if the input has none
+    size_t connection(size_t i) const {
+        if (m_source) {
+            return i % m_copies;
+        }
+        return (m_connection_ids.empty() ? 0 : m_connection_ids[i]);
+    }
+
+    unsigned char opcode(size_t i) const {
+        if (m_source) {
+            return m_source->opcode(i / m_copies);
+        }
+        return (m_opcodes.empty() ? opcode_text : m_opcodes[i]);
+    }
+
+    // time the message was sent in microseconds, or 0 if the input has none
+    uint64_t timestamp(size_t i) const {
+        if (m_source) {
+            return m_source->timestamp(i / m_copies);
+        }
+        return (m_timestamps.empty() ? 0 : m_timestamps[i]);
+    }
+
+    bool has_timestamps() const {
+        if (m_source) {
+            return m_source->has_timestamps();
+        }
+        for (uint64_t t : m_timestamps) {
+            if (t != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    unsigned char const * data(size_t i) const {
+        if (m_source) {
+            return m_source->data(i / m_copies);
+        }
+        return reinterpret_cast<unsigned char const *>(m_base)+m_offsets[i];
+    }
+
+    // Lines without a connection id are separated by a single newline, so
+    // their size is the distance to the next line
+    size_t size(size_t i) const {
+        if (m_source) {
+            return m_source->size(i / m_copies);
+        }
+        if (!m_sizes.empty()) {
+            return m_sizes[i];
+        }
+        return (i+1 < m_offsets.size() ? m_offsets[i+1] : m_end) - m_offsets[i] - 1;
+    }
+private:
+    corpus(corpus const &) = delete;
+    corpus & operator=(corpus const &) = delete;
+
+    bool index(bool id_column) {
+        m_offsets.clear();
+        m_sizes.clear();
+        m_connection_ids.clear();
+        m_opcodes.clear();
+        m_timestamps.clear();
+        m_connections = 0;
+
+        if (is_binary()) {
+            return index_binary();
+        }
+        return index_lines(id_column);
+    }
+
+    // Text that happens to start with the magic is still read as lines unless
+    // the version and flags that follow are ones this program writes
+    bool is_binary() const {
+        if (m_length < sizeof(corpus_magic)+2 ||
+            !std::equal(corpus_magic, corpus_magic+sizeof(corpus_magic), m_base))
+        {
+            return false;
+        }
+        unsigned char version = static_cast<unsigned char>(m_base[sizeof(corpus_magic)]);
+        unsigned char flags = static_cast<unsigned char>(m_base[sizeof(corpus_magic)+1]);
+        return version == corpus_version && (flags & ~corpus_flags_known) == 0;
+    }
+
+    // Build the message offset index with a single memchr scan for newlines.
+    // Returns false and prints an error if a line has no connection id.
+    bool index_lines(bool id_column) {
+        std::map<std::string,size_t> ids;
+
+        size_t start = 0;
+        size_t line = 0;
+        while (start < m_length) {
+            line++;
+            char const * nl = static_cast<char const *>(
+                memchr(m_base+start, '\n', m_length-start));
+            size_t end = (nl ? size_t(nl-m_base) : m_length);
+
+            size_t connection = 0;
+            if (id_column) {
+                char const * tab = static_cast<char const *>(
+                    memchr(m_base+start, '\t', end-start));
+                if (!tab) {
+                    std::cout << "Line " << line << " has no connection id column" 
+                              << std::endl;
+                    return false;
+                }
+                auto it = ids.insert(std::make_pair(
+                    std::string(m_base+start, tab), ids.size())).first;
+                connection = it->second;
+                start = size_t(tab-m_base)+1;
+            }
+
+            m_offsets.push_back(start);
+            if (id_column) {
+                m_sizes.push_back(end-start);
+                m_connection_ids.push_back(connection);
+            }
+            start = end+1;
+        }
+
+        m_end = start;
+        m_connections = ids.size();
+        return true;
+    }
+
+    bool index_binary() {
+        // the version was checked by is_binary
+        size_t pos = sizeof(corpus_magic)+1;
+        unsigned char flags = static_cast<unsigned char>(m_base[pos++]);
+
+        // only the fields the corpus has are kept
+        uint64_t timestamp = 0;
+        while (pos < m_length) {
+            size_t record = pos;
+            unsigned char opcode = opcode_text;
+            size_t connection = 0;
+            uint64_t value;
+
+            if (flags & corpus_flag_opcode) {
+                opcode = static_cast<unsigned char>(m_base[pos++]);
+            }
+            if (flags & corpus_flag_timestamp) {
+                if (!read_varint(m_base, m_length, pos, value)) {
+                    pos = record;
+                    break;
+                }
+                timestamp += value;
+            }
+            if (flags & corpus_flag_connection) {
+                if (!read_varint(m_base, m_length, pos, value)) {
+                    pos = record;
+                    break;
+                }
+                connection = size_t(value);
+                m_connections = std::max(m_connections, connection+1);
+            }
+            if (!read_varint(m_base, m_length, pos, value) || value > m_length-pos) {
+                pos = record;
+                break;
+            }
+
+            m_offsets.push_back(pos);
+            m_sizes.push_back(size_t(value));
+            if (flags & corpus_flag_opcode) {
+                m_opcodes.push_back(opcode);
+            }
+            if (flags & corpus_flag_timestamp) {
+                m_timestamps.push_back(timestamp);
+            }
+            if (flags & corpus_flag_connection) {
+                m_connection_ids.push_back(connection);
+            }
+            pos += size_t(value);
+        }
+
+        if (pos < m_length) {
+            std::cout << "Truncated binary corpus record at offset " << pos << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // input read from a stream is owned here, input from a file is mapped
+    std::string m_data;
+    file_mapping m_mapping;
+    char const * m_base;
+    size_t m_length;
+
+    // Offset of every message. The other fields are only kept for input that
+    // has them, so plain lines cost one offset per message and the end of
+    // the last line.
+    std::vector<size_t> m_offsets;
+    size_t m_end;
+    std::vector<size_t> m_sizes;
+    std::vector<size_t> m_connection_ids;
+    std::vector<unsigned char> m_opcodes;
+    std::vector<uint64_t> m_timestamps;
+    size_t m_connections;
+
+    // set for a view of another corpus
+    corpus const * m_source;
+    size_t m_copies;
+};
+
+size_t frame_overhead(bool masked, size_t payload_size) {
+    size_t size = (masked ? 4 : 0);
+
+    if (payload_size <= 125) {
+        size += 2;
+    } else if (payload_size <= 0xffff) {
+        size += 4;
+    } else {
+        size += 10;
+    }
+    return size;
+}
+
+// Number of frames a payload is sent in when frames carry at most
+// max_frame_size bytes of it. 0 sends every message in a single frame.
+size_t fragment_count(size_t payload_size, size_t max_frame_size) {
+    if (max_frame_size == 0 || payload_size <= max_frame_size) {
+        return 1;
+    }
+    return (payload_size + max_frame_size - 1) / max_frame_size;
+}
+
+// Total header size of the frames a payload is sent in
+size_t fragmented_frame_overhead(bool masked, size_t payload_size, size_t max_frame_size) {
+    size_t fragments = fragment_count(payload_size, max_frame_size);
+    if (fragments == 1) {
+        return frame_overhead(masked, payload_size);
+    }
+    size_t last = payload_size - (fragments-1)*max_frame_size;
+    return (fragments-1)*frame_overhead(masked, max_frame_size) + frame_overhead(masked, last);
+}
+
+// largest frame header: 2 bytes, a 64 bit extended length and a masking key
+const size_t max_frame_header = 14;
+
+// Write the RFC 6455 header of a frame with a payload of payload_size bytes to
+// out, which must have room for max_frame_header bytes, and return its size.
+// RSV1 marks the first frame of a permessage-deflate compressed message. The
+// masking key is only written when masked.
+size_t write_frame_header(unsigned char * out, bool fin, unsigned char opcode, 
+    bool rsv1, size_t payload_size, bool masked, unsigned char const * mask_key)
+{
+    out[0] = (fin ? 0x80 : 0x00) | (rsv1 ? 0x40 : 0x00) | (opcode & 0x0f);
+    unsigned char mask_bit = (masked ? 0x80 : 0x00);
+    size_t size = 2;
+
+    if (payload_size <= 125) {
+        out[1] = mask_bit | static_cast<unsigned char>(payload_size);
+    } else if (payload_size <= 0xffff) {
+        out[1] = mask_bit | 126;
+        out[2] = static_cast<unsigned char>(payload_size >> 8);
+        out[3] = static_cast<unsigned char>(payload_size);
+        size = 4;
+    } else {
+        out[1] = mask_bit | 127;
+        uint64_t length = payload_size;
+        for (int i = 9; i >= 2; i--) {
+            out[i] = static_cast<unsigned char>(length);
+            length >>= 8;
+        }
+        size = 10;
+    }
+
+    if (masked) {
+        std::memcpy(out+size, mask_key, 4);
+        size += 4;
+    }
+    return size;
+}
+
+// Copy a payload to out XORed with a client's masking key, one byte at a time
+// as in RFC 6455 section 5.3
+void mask_payload(unsigned char * out, unsigned char const * in, size_t size, 
+    unsigned char const * mask_key)
+{
+    for (size_t i = 0; i < size; i++) {
+        out[i] = in[i] ^ mask_key[i & 3];
+    }
+}
+
+// Widest store made by mask_payload_fast. AVX2 is only used when the compiler
+// targets it, e.g. with -mavx2 or -march=native. SSE2 is always available on
+// x86-64.
+#if defined(__AVX2__)
+const size_t mask_vector_size = 32;
+const char * const mask_kernel_name = "avx2";
+#elif defined(__SSE2__)
+const size_t mask_vector_size = 16;
+const char * const mask_kernel_name = "sse2";
+#else
+const size_t mask_vector_size = 8;
+const char * const mask_kernel_name = "64 bit scalar";
+#endif
+
+// Same result as mask_payload, and out may equal in. Bytes are masked one at
+// a time until out is aligned to mask_vector_size, then the key is rotated to
+// line up with the next byte and XORed 32, 16 and 8 bytes at a time with
+// aligned stores. The last few bytes are masked one at a time.
+void mask_payload_fast(unsigned char * out, unsigned char const * in, size_t size, 
+    unsigned char const * mask_key)
+{
+    size_t head = (mask_vector_size - reinterpret_cast<uintptr_t>(out) % mask_vector_size)
+        % mask_vector_size;
+    size_t i = 0;
+    for (; i < std::min(head, size); i++) {
+        out[i] = in[i] ^ mask_key[i & 3];
+    }
+
+    unsigned char rotated[4];
+    for (size_t j = 0; j < 4; j++) {
+        rotated[j] = mask_key[(i + j) & 3];
+    }
+    uint32_t key32;
+    std::memcpy(&key32, rotated, 4);
+    uint64_t key64 = uint64_t(key32) << 32 | key32;
+
+#if defined(__AVX2__)
+    __m256i key256 = _mm256_set1_epi32(int(key32));
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(in + i));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(out + i), _mm256_xor_si256(v, key256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i key128 = _mm_set1_epi32(int(key32));
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(in + i));
+        _mm_store_si128(reinterpret_cast<__m128i *>(out + i), _mm_xor_si128(v, key128));
+    }
+#endif
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, in + i, 8);
+        v ^= key64;
+        std::memcpy(out + i, &v, 8);
+    }
+
+    for (; i < size; i++) {
+        out[i] = in[i] ^ mask_key[i & 3];
+    }
+}
+
+// Size in bytes of the given level of CPU data cache, or 0 if it is unknown
+size_t cache_size(int level) {
+    long size = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    if (level == 2) {
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    } else if (level == 3) {
+        size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    }
+#endif
+    return (size > 0 ? size_t(size) : 0);
+}
+
+// Memory allocated by zlib for a single compression or decompression context.
+// Tracked by installing zlib_counting_alloc/zlib_counting_free on the z_stream
+struct zlib_memory {
+    size_t current = 0;
+    size_t peak = 0;
+    // bytes allocated once the context has processed the whole test
+    size_t steady = 0;
+};
+
+// zfree is not told the size of the block it frees so each allocation is
+// prefixed with a header that records it.
+union zlib_alloc_header {
+    size_t size;
+    std::max_align_t align;
+};
+
+voidpf zlib_counting_alloc(voidpf opaque, uInt items, uInt size) {
+    zlib_memory * mem = static_cast<zlib_memory *>(opaque);
+    size_t bytes = size_t(items)*size_t(size);
+
+    zlib_alloc_header * h = static_cast<zlib_alloc_header *>(
+        std::malloc(sizeof(zlib_alloc_header)+bytes));
+    if (!h) {
+        return Z_NULL;
+    }
+    h->size = bytes;
+
+    mem->current += bytes;
+    if (mem->current > mem->peak) {
+        mem->peak = mem->current;
+    }
+    return h+1;
+}
+
+void zlib_counting_free(voidpf opaque, voidpf address) {
+    zlib_memory * mem = static_cast<zlib_memory *>(opaque);
+    zlib_alloc_header * h = static_cast<zlib_alloc_header *>(address)-1;
+
+    mem->current -= h->size;
+    std::free(h);
+}
+
+void init_zlib_allocator(z_stream & zlib_state, zlib_memory & mem) {
+    zlib_state.zalloc = zlib_counting_alloc;
+    zlib_state.zfree = zlib_counting_free;
+    zlib_state.opaque = &mem;
+}
+
+// Log-linear histogram of non-negative integer values in the style of an HDR
+// histogram. Values are counted exactly up to 255 and with under 1% error
+// above that. Memory grows with the logarithm of the largest value recorded,
+// never with the number of values.
+class hdr_histogram {
+public:
+    hdr_histogram() : m_count(0), m_max(0) {}
+
+    void record(uint64_t value) {
+        size_t i = index(value);
+        if (i >= m_counts.size()) {
+            m_counts.resize(i+1, 0);
+        }
+        m_counts[i]++;
+        m_count++;
+        m_max = std::max(m_max, value);
+    }
+
+    uint64_t count() const {
+        return m_count;
+    }
+
+    uint64_t max() const {
+        return m_max;
+    }
+
+    // the value that q (0...1) of all recorded values are less than or
+    // equal to, to within the precision of the histogram
+    uint64_t value_at_quantile(double q) const {
+        if (m_count == 0) {
+            return 0;
+        }
+
+        uint64_t target = uint64_t(q*double(m_count)+0.5);
+        target = std::min(std::max<uint64_t>(target,1), m_count);
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); i++) {
+            seen += m_counts[i];
+            if (seen >= target) {
+                return std::min(highest_equivalent(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    double mean() const {
+        if (m_count == 0) {
+            return 0;
+        }
+        double sum = 0;
+        for (size_t i = 0; i < m_counts.size(); i++) {
+            sum += double(m_counts[i])*double(median_equivalent(i));
+        }
+        return sum/double(m_count);
+    }
+
+    // Write the cumulative distribution in the text format of HdrHistogram's
+    // percentile output, which its plotting tools accept. Values are divided
+    // by scale, for example 1000 to write nanoseconds as microseconds.
+    void write_percentiles(std::ostream & out, double scale) const {
+        out << std::fixed
+            << std::setw(12) << "Value" << " " << std::setw(14) << "Percentile" << " "
+            << std::setw(10) << "TotalCount" << " " << std::setw(14) << "1/(1-Percentile)"
+            << "\n\n";
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); i++) {
+            if (m_counts[i] == 0) {
+                continue;
+            }
+            seen += m_counts[i];
+
+            double percentile = double(seen)/double(m_count);
+            uint64_t value = std::min(highest_equivalent(i), m_max);
+
+            out << std::setw(12) << std::setprecision(3) << double(value)/scale << " "
+                << std::setw(14) << std::setprecision(12) << percentile << " "
+                << std::setw(10) << seen << " ";
+            if (seen < m_count) {
+                out << std::setw(14) << std::setprecision(2) << 1.0/(1.0-percentile);
+            }
+            out << "\n";
+        }
+
+        out << "#[Mean    = " << std::setw(12) << std::setprecision(3) << mean()/scale 
+            << "]\n"
+            << "#[Max     = " << std::setw(12) << std::setprecision(3) << double(m_max)/scale 
+            << ", Total count    = " << std::setw(12) << m_count << "]\n";
+        out.unsetf(std::ios::floatfield);
+    }
+private:
+    static const int sub_bucket_bits = 7;
+    static const uint64_t sub_buckets = uint64_t(1) << sub_bucket_bits;
+
+    static size_t index(uint64_t value) {
+        if (value < 2*sub_buckets) {
+            return size_t(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - sub_bucket_bits;
+        return size_t(shift*sub_buckets + (value >> shift));
+    }
+
+    static uint64_t highest_equivalent(size_t i) {
+        if (i < 2*sub_buckets) {
+            return i;
+        }
+        int shift = int(i/sub_buckets) - 1;
+        uint64_t sub = i - shift*sub_buckets;
+        return ((sub+1) << shift) - 1;
+    }
+
+    static uint64_t median_equivalent(size_t i) {
+        if (i < 2*sub_buckets) {
+            return i;
+        }
+        int shift = int(i/sub_buckets) - 1;
+        uint64_t sub = i - shift*sub_buckets;
+        return (sub << shift) + (uint64_t(1) << shift)/2;
+    }
+
+    std::vector<uint64_t> m_counts;
+    uint64_t m_count;
+    uint64_t m_max;
+};
+
+// The clock used to time messages. By default this is std::chrono's steady
+// clock. Building with -DWSPMCE_TIMER_RDTSC uses the x86 time stamp counter
+// instead, serialized so that the timed code cannot be reordered around the
+// readings, and calibrated against the steady clock at startup.
+struct message_clock {
+    typedef uint64_t ticks;
+
+#if defined(WSPMCE_TIMER_RDTSC)
+    static char const * name() {
+        return "rdtsc";
+    }
+
+    static ticks start() {
+        _mm_lfence();
+        ticks t = __rdtsc();
+        _mm_lfence();
+        return t;
+    }
+
+    static ticks stop() {
+        unsigned int aux;
+        ticks t = __rdtscp(&aux);
+        _mm_lfence();
+        return t;
+    }
+
+    static double seconds_per_tick() {
+        static double const value = calibrate();
+        return value;
+    }
+#else
+    static char const * name() {
+        return "steady_clock";
+    }
+
+    static ticks start() {
+        return ticks(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    static ticks stop() {
+        return start();
+    }
+
+    static double seconds_per_tick() {
+        return 1.0/1000000000.0;
+    }
+#endif
+
+    // the smallest interval measured between back to back start and stop
+    // readings. This is subtracted from every measurement.
+    static ticks overhead() {
+        static ticks const value = measure_overhead();
+        return value;
+    }
+
+    static double to_seconds(ticks t) {
+        return double(t)*seconds_per_tick();
+    }
+private:
+#if defined(WSPMCE_TIMER_RDTSC)
+    static double calibrate() {
+        auto wall_start = std::chrono::steady_clock::now();
+        ticks tsc_start = start();
+
+        while (std::chrono::steady_clock::now()-wall_start < std::chrono::milliseconds(50)) {}
+
+        ticks tsc_end = stop();
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now()-wall_start;
+        return wall.count()/double(tsc_end-tsc_start);
+    }
+#endif
+
+    static ticks measure_overhead() {
+        ticks best = ~ticks(0);
+        for (int i = 0; i < 10000; i++) {
+            ticks t0 = start();
+            ticks t1 = stop();
+            best = std::min(best, t1-t0);
+        }
+        return best;
+    }
+};
+
+// Hardware performance counters for the calling thread, read around each
+// timed zlib call when perf_counters=true. Only available on Linux, and only
+// for the events the processor (or hypervisor) exposes.
+const size_t perf_counter_count = 5;
+const char * const perf_counter_names[perf_counter_count] = {
+    "cycles", "instructions", "L1d misses", "LLC misses", "branch misses"
+};
+
+class perf_counters {
+public:
+    enum { cycles, instructions, l1d_misses, llc_misses, branch_misses };
+
+    perf_counters() : m_leader(-1) {
+        for (size_t i = 0; i < perf_counter_count; i++) {
+            m_fds[i] = -1;
+            m_slot[i] = -1;
+            m_start[i] = 0;
+        }
+    }
+
+    ~perf_counters() {
+        for (size_t i = 0; i < perf_counter_count; i++) {
+            if (m_fds[i] >= 0) {
+                close(m_fds[i]);
+            }
+        }
+    }
+
+    // Open the counters as a single group so that they can be read together.
+    // Returns false with a reason if no counters could be opened.
+    bool open(std::string & error) {
+#if defined(__linux__)
+        uint32_t const types[perf_counter_count] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, 
+            PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+        };
+        uint64_t const configs[perf_counter_count] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) 
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) 
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        int slots = 0;
+        for (size_t i = 0; i < perf_counter_count; i++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+
+            int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, m_leader, 0));
+            if (fd < 0) {
+                if (m_leader < 0) {
+                    error = strerror(errno);
+                }
+                continue;
+            }
+            if (m_leader < 0) {
+                m_leader = fd;
+            }
+            m_fds[i] = fd;
+            m_slot[i] = slots++;
+        }
+
+        if (m_leader < 0) {
+            return false;
+        }
+        ioctl(m_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(m_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+#else
+        error = "hardware counters are only supported on Linux";
+        return false;
+#endif
+    }
+
+    bool available(size_t i) const {
+        return m_slot[i] >= 0;
+    }
+
+    void start() {
+        read_values(m_start);
+    }
+
+    // counts since the last call to start()
+    void stop(uint64_t (&delta)[perf_counter_count]) {
+        uint64_t end[perf_counter_count];
+        read_values(end);
+        for (size_t i = 0; i < perf_counter_count; i++) {
+            delta[i] = end[i]-m_start[i];
+        }
+    }
+private:
+    void read_values(uint64_t (&values)[perf_counter_count]) {
+        // PERF_FORMAT_GROUP: the number of counters, then each value
+        uint64_t buf[1+perf_counter_count] = {0};
+        if (m_leader < 0 || read(m_leader, buf, sizeof(buf)) < ssize_t(sizeof(uint64_t))) {
+            std::fill(values, values+perf_counter_count, 0);
+            return;
+        }
+        for (size_t i = 0; i < perf_counter_count; i++) {
+            values[i] = (m_slot[i] >= 0 ? buf[1+m_slot[i]] : 0);
+        }
+    }
+
+    perf_counters(perf_counters const &) = delete;
+    perf_counters & operator=(perf_counters const &) = delete;
+
+    int m_leader;
+    int m_fds[perf_counter_count];
+    int m_slot[perf_counter_count];
+    uint64_t m_start[perf_counter_count];
+};
+
+// The three payload length encodings of a WebSocket frame header, which are
+// also used to break down per message stats by size
+const size_t size_class_count = 3;
+const char * const size_class_names[size_class_count] = {
+    "payload <= 125B", "payload <= 64KiB", "payload > 64KiB"
+};
+
+size_t size_class(size_t payload_size) {
+    if (payload_size <= 125) {
+        return 0;
+    } else if (payload_size <= 0xffff) {
+        return 1;
+    }
+    return 2;
+}
+
+// zlib compression strategies, indexed by their zlib constant
+const int strategy_count = 5;
+const char * const strategy_names[strategy_count] = {
+    "default", "filtered", "huffman_only", "rle", "fixed"
+};
+
+// zlib constant for a strategy name, or -1 if there is no such strategy
+int parse_strategy(std::string const & name) {
+    for (int i = 0; i < strategy_count; i++) {
+        if (name == strategy_names[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// parse a size such as 4096, 64KiB, 64KB, 1MiB or 2GiB into bytes
+size_t parse_bytes(std::string const & val) {
+    char * unit;
+    double v = strtod(val.c_str(), &unit);
+    std::string u(unit);
+
+    if (u == "KiB" || u == "K" || u == "k") {
+        v *= 1024;
+    } else if (u == "MiB" || u == "M") {
+        v *= 1024*1024;
+    } else if (u == "KB" || u == "kB") {
+        v *= 1000;
+    } else if (u == "MB") {
+        v *= 1000*1000;
+    } else if (u == "GiB" || u == "G") {
+        v *= 1024.0*1024.0*1024.0;
+    } else if (u == "GB") {
+        v *= 1000.0*1000.0*1000.0;
+    }
+    return size_t(v);
+}
+
+// parse a duration such as 20us, 1.5ms, 0.001s or 5min into seconds
+double parse_seconds(std::string const & val) {
+    char * unit;
+    double v = strtod(val.c_str(), &unit);
+    std::string u(unit);
+
+    if (u == "ns") {
+        v /= 1000000000.0;
+    } else if (u == "us") {
+        v /= 1000000.0;
+    } else if (u == "ms") {
+        v /= 1000.0;
+    } else if (u == "min") {
+        v *= 60.0;
+    }
+    return v;
+}
+
+// How messages are kept independent without context takeover: a full flush
+// on a stream that lives as long as the connection, or a context restored with
+// deflateReset/inflateReset, or freed and initialized again, before each one
+const int reset_mode_full_flush = 0;
+const int reset_mode_reset = 1;
+const int reset_mode_reinit = 2;
+const int reset_mode_count = 3;
+const char * const reset_mode_names[reset_mode_count] = {
+    "full_flush", "deflateReset", "reinit"
+};
+
+int parse_reset_mode(std::string const & name) {
+    for (int i = 0; i < reset_mode_count; i++) {
+        if (name == reset_mode_names[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct line_result {
+    size_t payload_size = 0;
+    size_t frame_overhead = 0;
+    size_t frame_overhead_compressed = 0;
+    size_t compressed_size = 0;
+    double ratio = 0;
+    // test length in sec
+    double elapsed_seconds = 0;
+    // part of elapsed_seconds spent resetting the context before the message
+    double setup_seconds = 0;
+    // parts of elapsed_seconds spent building the frame header and masking
+    // the payload, if frames is set
+    double header_seconds = 0;
+    double mask_seconds = 0;
+    // part of elapsed_seconds spent validating an inflated text message, and
+    // the time the scalar validator took on it outside of elapsed_seconds,
+    // if validate_utf8 is set
+    double validate_seconds = 0;
+    double validate_scalar_seconds = 0;
+    bool validated = false;
+    bool valid_utf8 = true;
+    // frames the message was sent in, more than one if max_frame_size is set
+    size_t fragments = 1;
+    // false if the compression policy sent the message without RSV1 set
+    bool compressed = true;
+
+    // hardware counter deltas around the timed call, if perf_counters is set
+    uint64_t counters[perf_counter_count] = {0, 0, 0, 0, 0};
+};
+
+struct test_result {
+    bool error = false;
+
+    // test settings
+    bool is_server = true;
+    bool sending = true;
+    bool context_takeover = true;
+    int speed_level = 6;
+    int window_bits = 15;
+    int memory_level = 8;
+    int strategy = Z_DEFAULT_STRATEGY;
+    // used only without context takeover
+    int reset_mode = reset_mode_full_flush;
+    // compression policy. Messages smaller than min_size bytes, with an
+    // estimated entropy above max_entropy bits per byte or that compress to
+    // a ratio above max_ratio are sent uncompressed. 0 disables each test.
+    size_t min_size = 0;
+    double max_entropy = 0;
+    double max_ratio = 0;
+    // context hibernation. A deflate context unused for idle_timeout seconds
+    // of input timestamps, or for idle_messages messages, is freed and set up
+    // again for its connection's next message. 0 disables each.
+    double idle_timeout = 0;
+    size_t idle_messages = 0;
+    // total memory all deflate contexts may use. Only the most recently used
+    // contexts that fit are kept; others start over with an empty window.
+    size_t context_budget = 0;
+    // write each message sent as a WebSocket frame, masked when simulating a
+    // client, as part of the time taken to send it
+    bool frames = false;
+    // check that inflated text messages are valid UTF-8, as a receiver must,
+    // as part of the time taken to receive them
+    bool validate_utf8 = false;
+    // largest payload of a frame. Longer messages are compressed in a stream
+    // and sent as continuation frames as the output becomes available. 0
+    // sends every message in one frame.
+    size_t max_frame_size = 0;
+    // number of independent compression contexts. 0 means one per connection
+    // id when connection_id_column is set and a single context otherwise.
+    size_t connections = 0;
+    bool connection_id_column = false;
+    // keep every line_result, for per message dumps
+    bool keep_messages = false;
+    std::string dump_file;
+    // file to write the latency histogram to
+    std::string histogram_file;
+    // number of measured and discarded runs over the corpus
+    int repeat = 1;
+    int warmup = 0;
+    // read hardware performance counters around every timed call
+    bool perf_counters = false;
+    // preset dictionary agreed by both endpoints and the file it was read
+    // from. Shared between the copies of a test made by repeat and sweep.
+    std::string dictionary_file;
+    std::shared_ptr<std::string const> dictionary;
+
+    // test results, accumulated as each message is recorded so that memory
+    // use does not depend on the number of messages
+    size_t messages = 0;
+    size_t uncompressed_messages = 0;
+    size_t total_payload = 0;
+    size_t total_frame_overhead = 0;
+    size_t total_frame_overhead_compressed = 0;
+    size_t total_compressed_size = 0;
+    double total_elapsed_seconds = 0;
+    double total_setup_seconds = 0;
+    double total_header_seconds = 0;
+    double total_mask_seconds = 0;
+    size_t validated_messages = 0;
+    size_t invalid_utf8_messages = 0;
+    double total_validate_seconds = 0;
+    double total_validate_scalar_seconds = 0;
+    size_t total_fragments = 0;
+    size_t total_fragment_overhead = 0;
+
+    // payload size in bytes, compression ratio in 1/10000ths and time per
+    // message in nanoseconds
+    hdr_histogram size_histogram;
+    hdr_histogram ratio_histogram;
+    hdr_histogram latency_histogram;
+    // time per message in nanoseconds, by size_class of the payload
+    hdr_histogram size_class_latency[size_class_count];
+    // with max_frame_size, nanoseconds taken to get each fragment ready and
+    // from the start of each message until its first fragment was ready
+    hdr_histogram fragment_latency;
+    hdr_histogram first_byte_latency;
+
+    // per message results, only kept if keep_messages is set
+    std::vector<line_result> line_results;
+
+    // aggregate stats
+    double total_ratio;
+    double p99_elapsed_seconds;
+
+    // clock overhead subtracted from each timing
+    double clock_overhead_seconds = 0;
+
+    // hardware counter totals, and which counters could be opened
+    uint64_t counter_totals[perf_counter_count] = {0, 0, 0, 0, 0};
+    bool counter_available[perf_counter_count] = {false, false, false, false, false};
+    std::string counter_error;
+
+    // throughput in MB/s of each measured repetition, its mean, standard
+    // deviation and the half width of its 95% confidence interval
+    std::vector<double> repetition_throughput;
+    double throughput_mean = 0;
+    double throughput_stddev = 0;
+    double throughput_ci95 = 0;
+
+    // memory stats
+    size_t mem_usage;
+    size_t mem_usage_inflate_32;
+    size_t mem_usage_inflate_64;
+
+    // contexts freed by hibernation, and the memory of every context
+    // multiplied by the time it was held, in byte seconds (byte messages with
+    // idle_messages), with hibernation and if contexts were never freed
+    size_t hibernations = 0;
+    double context_memory_time = 0;
+    double context_memory_time_always = 0;
+
+    // contexts that fit in context_budget, and messages whose context was
+    // resident, had to be set up again after an eviction, or was set up for
+    // the connection's first message
+    size_t lru_capacity = 0;
+    size_t lru_hits = 0;
+    size_t lru_misses = 0;
+    size_t lru_first_uses = 0;
+
+    // memory stats measured by the zlib allocation hooks
+    zlib_memory deflate_memory;
+    zlib_memory inflate_memory;
+    // combined memory of all connection contexts
+    size_t working_set = 0;
+    // size of the buffer compressed output was written to, and the size it
+    // would have needed to hold the largest message compressed in one go
+    size_t output_buffer_peak = 0;
+    size_t output_buffer_whole = 0;
+
+    void load_setting(std::string arg) {
+        auto pos = arg.find('=');
+        if (pos != std::string::npos) {
+            std::string key(arg.begin(),arg.begin()+pos);
+            std::string val(arg.begin()+pos+1,arg.end());
+            
+            if (key == "server") {
+                is_server = (val == "true" ? true : false);
+            } else if (key == "sending") {
+                sending = (val == "true" ? true : false);
+            } else if (key == "context_takeover") {
+                context_takeover = (val == "true" ? true : false);
+            } else if (key == "speed_level" || key == "speed_levels") {
+                speed_level = atoi(val.c_str()); 
+            } else if (key == "window_bits") {
+                window_bits = atoi(val.c_str()); 
+            } else if (key == "memory_level") {
+                memory_level = atoi(val.c_str()); 
+            } else if (key == "strategy") {
+                strategy = parse_strategy(val);
+            } else if (key == "reset_mode") {
+                reset_mode = parse_reset_mode(val);
+            } else if (key == "idle_timeout") {
+                idle_timeout = parse_seconds(val);
+            } else if (key == "idle_messages") {
+                idle_messages = atoi(val.c_str());
+            } else if (key == "context_budget") {
+                context_budget = parse_bytes(val);
+            } else if (key == "min_size") {
+                min_size = atoi(val.c_str());
+            } else if (key == "max_entropy") {
+                max_entropy = atof(val.c_str());
+            } else if (key == "max_ratio") {
+                max_ratio = atof(val.c_str());
+            } else if (key == "connections") {
+                connections = atoi(val.c_str());
+            } else if (key == "connection_id") {
+                connection_id_column = (val == "column");
+            } else if (key == "frames") {
+                frames = (val == "true");
+            } else if (key == "validate_utf8") {
+                validate_utf8 = (val == "true");
+            } else if (key == "max_frame_size") {
+                max_frame_size = parse_bytes(val);
+            } else if (key == "perf_counters") {
+                perf_counters = (val == "true");
+            } else if (key == "repeat") {
+                repeat = std::max(1, atoi(val.c_str()));
+            } else if (key == "warmup") {
+                warmup = std::max(0, atoi(val.c_str()));
+            } else if (key == "histogram") {
+                histogram_file = val;
+            } else if (key == "dictionary") {
+                dictionary_file = val;
+            } else if (key == "dump") {
+                dump_file = val;
+                keep_messages = !val.empty();
+            }
+        }
+    }
+
+    bool check_validity() {
+        if (speed_level > 9 || speed_level < 0) {
+            std::cout << "Speed level must be between 0 (fastest, no compression) and 9 (slowest, best compression). Default is 6" << std::endl;
+            error = true;
+        }
+        if (window_bits > 15 || window_bits < 8) {
+            std::cout << "Window bits must be between 8 (lower memory usage, worse compression) and 15 (highest memory usage, best compression). Default is 15." << std::endl;
+            error = true;
+        }
+        if (memory_level > 9 || memory_level < 1) {
+            std::cout << "Memory level must be between 1 (lower memory usage, worse compression) and 9 (highest memory usage, best compression). Default is 8." << std::endl;
+            error = true;
+        }
+        if ((hibernating() || context_budget > 0) && !sending) {
+            std::cout << "Hibernation and context_budget free deflate contexts and can only be simulated when sending. A receiver must keep its inflate window for as long as the sender may refer to it." << std::endl;
+            error = true;
+        }
+        if (frames && !sending) {
+            std::cout << "Frames are only written when sending." << std::endl;
+            error = true;
+        }
+        if (validate_utf8 && sending) {
+            std::cout << "UTF-8 is only validated when receiving." << std::endl;
+            error = true;
+        }
+        if (max_frame_size > 0 && !sending) {
+            std::cout << "Fragmentation with max_frame_size is only simulated when sending." << std::endl;
+            error = true;
+        }
+        if (max_frame_size > 0 && max_ratio > 0) {
+            std::cout << "max_ratio needs a message compressed in full before any of it is sent and cannot be combined with max_frame_size." << std::endl;
+            error = true;
+        }
+        if (hibernating() && context_budget > 0) {
+            std::cout << "Hibernation and context_budget cannot be combined." << std::endl;
+            error = true;
+        }
+        if (reset_mode < 0 || reset_mode >= reset_mode_count) {
+            std::cout << "Reset mode must be one of full_flush, deflateReset or reinit. Default is full_flush." << std::endl;
+            error = true;
+        }
+        if (strategy < 0 || strategy >= strategy_count) {
+            std::cout << "Strategy must be one of default, filtered, huffman_only, rle or fixed. Default is default." << std::endl;
+            error = true;
+        }
+        return !error;
+    }
+
+    // The reset done before each message. A full flush discards a preset
+    // dictionary along with the rest of the window, so with a dictionary
+    // full_flush is replaced by deflateReset, which reloads it.
+    int message_reset_mode() const {
+        if (context_takeover) {
+            return reset_mode_full_flush;
+        }
+        if (dictionary && reset_mode == reset_mode_full_flush) {
+            return reset_mode_reset;
+        }
+        return reset_mode;
+    }
+
+    bool hibernating() const {
+        return idle_timeout > 0 || idle_messages > 0;
+    }
+
+    bool has_policy() const {
+        return min_size > 0 || max_entropy > 0 || max_ratio > 0;
+    }
+
+    // add the result of one message to the running totals
+    void record(line_result const & lr) {
+        messages++;
+        if (!lr.compressed) {
+            uncompressed_messages++;
+        }
+        total_payload += lr.payload_size;
+        total_frame_overhead += lr.frame_overhead;
+        total_frame_overhead_compressed += lr.frame_overhead_compressed;
+        total_compressed_size += lr.compressed_size;
+        total_elapsed_seconds += lr.elapsed_seconds;
+        total_setup_seconds += lr.setup_seconds;
+        total_header_seconds += lr.header_seconds;
+        total_mask_seconds += lr.mask_seconds;
+        if (lr.validated) {
+            validated_messages++;
+            if (!lr.valid_utf8) {
+                invalid_utf8_messages++;
+            }
+        }
+        total_validate_seconds += lr.validate_seconds;
+        total_validate_scalar_seconds += lr.validate_scalar_seconds;
+        total_fragments += lr.fragments;
+        if (lr.fragments > 1) {
+            total_fragment_overhead += lr.frame_overhead_compressed 
+                - frame_overhead(!is_server, lr.compressed_size);
+        }
+
+        for (size_t i = 0; i < perf_counter_count; i++) {
+            counter_totals[i] += lr.counters[i];
+        }
+
+        size_histogram.record(lr.payload_size);
+        ratio_histogram.record(uint64_t(lr.ratio*10000.0+0.5));
+        latency_histogram.record(uint64_t(lr.elapsed_seconds*1000000000.0+0.5));
+        size_class_latency[size_class(lr.payload_size)].record(
+            uint64_t(lr.elapsed_seconds*1000000000.0+0.5));
+
+        if (keep_messages) {
+            line_results.push_back(lr);
+        }
+    }
+
+    // build aggregate stats from the running totals
+    void calc_stats() {
+        p99_elapsed_seconds = double(latency_histogram.value_at_quantile(0.99))/1000000000.0;
+
+        total_ratio = double(total_compressed_size) / double(total_payload);
+
+        if (sending) {
+            mem_usage = (1 << (window_bits + 2)) + (1 << (memory_level + 9));
+            mem_usage_inflate_32 = (1 << window_bits) + 1440*2*4;
+            mem_usage_inflate_64 = (1 << window_bits) + 1440*2*8;
+        } else {
+            mem_usage = (1 << window_bits) + 1440*2*sizeof(int);
+            mem_usage_inflate_32 = 0;
+            mem_usage_inflate_64 = 0;
+        }
+    }
+
+    void print_stats() {
+        std::cout << "simulating: " << (is_server ? "server " : "client ") 
+                  << (sending ? "sending " : "receiving ") << std::endl;
+        std::cout << "settings: context_takeover=" << (context_takeover ? "true " : "false ")
+                  << "speed_level=" << speed_level
+                  << " window_bits=" << window_bits
+                  << " memory_level=" << memory_level
+                  << " strategy=" << strategy_names[strategy]
+                  << " connections=" << connections;
+        if (!context_takeover) {
+            std::cout << " reset_mode=" << reset_mode_names[message_reset_mode()];
+        }
+        if (dictionary) {
+            std::cout << " dictionary=" << dictionary_file 
+                      << " (" << dictionary->size() << " bytes)";
+        }
+        if (context_budget > 0) {
+            std::cout << " context_budget=" << context_budget;
+        }
+        if (frames) {
+            std::cout << " frames=true";
+        }
+        if (validate_utf8) {
+            std::cout << " validate_utf8=true";
+        }
+        if (max_frame_size > 0) {
+            std::cout << " max_frame_size=" << max_frame_size;
+        }
+        if (hibernating()) {
+            std::cout << " idle_timeout=" << idle_timeout << "s idle_messages=" << idle_messages;
+        }
+        if (has_policy()) {
+            std::cout << " min_size=" << min_size << " max_entropy=" << max_entropy
+                      << " max_ratio=" << max_ratio;
+        }
+        std::cout << std::endl << std::endl;
+        
+        calc_stats();
+
+        std::cout << std::left << std::setw(32) <<  "Messages processed: " 
+                  << messages << std::endl;
+
+        if (has_policy()) {
+            std::cout << std::left << std::setw(32) << "Sent uncompressed: " 
+                      << uncompressed_messages << " (" 
+                      << (messages == 0 ? 0.0 : double(uncompressed_messages)/double(messages)*100.0)
+                      << "%)" << std::endl;
+        }
+
+        std::cout << std::left << std::setw(32) << "Payload size (uncompressed): " 
+                  << double(total_payload)/1000.0 << "KB" << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Payload size (compressed): " 
+                  << double(total_compressed_size)/1000.0 << "KB" << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Frame overhead (uncompressed): " 
+                  << (double(total_frame_overhead) /
+                      double(total_payload + total_frame_overhead))*100.0 
+                  << "%" << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Frame overhead (compressed): " 
+                  << (double(total_frame_overhead_compressed) / 
+                     double(total_compressed_size + total_frame_overhead_compressed))*100.0 
+                  << "%" << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Total size (uncompressed): " 
+                  << double(total_payload+total_frame_overhead)/1000.0 << "KB" << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Total size (compressed): " 
+                  << double(total_compressed_size+total_frame_overhead_compressed)/1000.0 << "KB\n" 
+                  << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Payload compression ratio: " 
+                  << total_ratio << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Message ratio p50/p99: " 
+                  << double(ratio_histogram.value_at_quantile(0.5))/10000.0 << " / "
+                  << double(ratio_histogram.value_at_quantile(0.99))/10000.0 << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Message size p50/p99: " 
+                  << size_histogram.value_at_quantile(0.5) << "B / "
+                  << size_histogram.value_at_quantile(0.99) << "B" << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Elapsed Time: " << total_elapsed_seconds*1000.0
+                  << "ms" << std::endl;
+
+        std::cout << std::left << std::setw(32) 
+                  << (sending ? "Deflate throughput: " : "Inflate throughput: ")
+                  << (total_elapsed_seconds == 0 ? 0.0 :
+                      (double(total_payload)/1000000.0) / total_elapsed_seconds)
+                  << "MB/s" << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Mean latency per message: " 
+                  << (messages == 0 ? 0.0 : 
+                      total_elapsed_seconds*1000000.0 / double(messages))
+                  << "us" << std::endl;
+
+        if (hibernating()) {
+            std::cout << std::left << std::setw(32) << "Contexts hibernated: " 
+                      << hibernations << std::endl;
+            std::cout << std::left << std::setw(32) << "Context memory held: " 
+                      << context_memory_time/1024.0 
+                      << (idle_timeout > 0 ? "KiB-s" : "KiB-messages") << " vs " 
+                      << context_memory_time_always/1024.0 << " without hibernation ("
+                      << (1.0 - context_memory_time/context_memory_time_always)*100.0 
+                      << "% saved)" << std::endl;
+        }
+
+        if (context_budget > 0) {
+            std::cout << std::left << std::setw(32) << "Resident contexts: " 
+                      << lru_capacity << " (" << double(context_budget)/1024.0 
+                      << "KiB budget)" << std::endl;
+            std::cout << std::left << std::setw(32) << "Context hit rate: " 
+                      << (lru_hits+lru_misses == 0 ? 100.0 
+                          : double(lru_hits)/double(lru_hits+lru_misses)*100.0)
+                      << "% (" << lru_misses << " set up again, " << lru_first_uses
+                      << " first uses not counted)" << std::endl;
+            std::cout << std::left << std::setw(32) << "Context setup time: " 
+                      << total_setup_seconds*1000.0 << "ms (" 
+                      << (total_elapsed_seconds == 0 ? 0.0 :
+                          total_setup_seconds/total_elapsed_seconds*100.0)
+                      << "% of elapsed)" << std::endl;
+        }
+
+        if (message_reset_mode() != reset_mode_full_flush) {
+            std::cout << std::left << std::setw(32) << "Reset time per message: " 
+                      << (messages == 0 ? 0.0 : 
+                          total_setup_seconds*1000000.0 / double(messages))
+                      << "us (" << (total_elapsed_seconds == 0 ? 0.0 :
+                          total_setup_seconds/total_elapsed_seconds*100.0)
+                      << "% of elapsed)" << std::endl;
+        }
+
+        if (frames) {
+            print_pipeline();
+        }
+
+        if (validate_utf8) {
+            print_validation();
+        }
+
+        if (max_frame_size > 0) {
+            print_fragmentation();
+        }
+
+        if (repetition_throughput.size() > 1) {
+            print_repetitions();
+        }
+
+        if (perf_counters) {
+            print_counters();
+        }
+
+        std::cout << std::left << std::setw(32) << "Timing: " << message_clock::name() 
+                  << ", " << WSPMCE_TIMING_BATCH << " message(s) per reading, " 
+                  << clock_overhead_seconds*1000000000.0 << "ns overhead subtracted" 
+                  << std::endl;
+
+        std::cout << std::left << std::setw(32) << "Latency p50/p90/p99/p99.9/max: ";
+        print_percentiles(latency_histogram);
+        std::cout << std::endl;
+
+        for (size_t i = 0; i < size_class_count; i++) {
+            if (size_class_latency[i].count() == 0) {
+                continue;
+            }
+            std::ostringstream label;
+            label << "  " << size_class_names[i] << " (" << size_class_latency[i].count() << "): ";
+            std::cout << std::left << std::setw(32) << label.str();
+            print_percentiles(size_class_latency[i]);
+            std::cout << std::endl;
+        }
+        std::cout << std::endl;
+
+        if (sending) {
+            double mem_score = ((1.0 - total_ratio)*100.0) / (double(mem_usage) / 1024.0);
+
+            std::cout << "Memory used: " << double(mem_usage)/1024.0 << "KiB " 
+                      << (context_takeover ? "per connection" : "total") 
+                      << " for compression state." << std::endl;
+            std::cout << "Minimum memory required to decompress: " 
+                      << double(mem_usage_inflate_32)/1024.0 << "KiB (32 bit systems), "
+                      << double(mem_usage_inflate_64)/1024.0 << "KiB (64 bit systems)"
+                      << std::endl;
+            std::cout << "Memory measured: " << double(deflate_memory.steady)/1024.0 
+                      << "KiB steady state, " << double(deflate_memory.peak)/1024.0 
+                      << "KiB peak for compression state." << std::endl;
+            std::cout << "Memory measured to decompress: " 
+                      << double(inflate_memory.steady)/1024.0 << "KiB steady state, " 
+                      << double(inflate_memory.peak)/1024.0 << "KiB peak (this system)" 
+                      << std::endl;
+            std::cout << "Memory efficiency score: " << mem_score << " % Compression per KiB of memory" << std::endl; 
+        } else {
+            std::cout << "Memory used: " << double(mem_usage)/1024.0 << "KiB " 
+                      << (context_takeover ? "per connection" : "total") 
+                      << " for decompression state." << std::endl;
+            std::cout << "Memory measured: " << double(inflate_memory.steady)/1024.0 
+                      << "KiB steady state, " << double(inflate_memory.peak)/1024.0 
+                      << "KiB peak for decompression state." << std::endl;
+            std::cout << "Memory measured by sender: " 
+                      << double(deflate_memory.steady)/1024.0 << "KiB steady state, " 
+                      << double(deflate_memory.peak)/1024.0 << "KiB peak for compression state."
+                      << std::endl;
+        }
+
+        if (connections > 1) {
+            size_t l2 = cache_size(2);
+            size_t l3 = cache_size(3);
+
+            std::cout << "Combined state of " << connections << " connections: " 
+                      << double(working_set)/1024.0 << "KiB";
+            if (l3 && working_set > l3) {
+                std::cout << " (exceeds " << double(l3)/1024.0 << "KiB L3 cache)";
+            } else if (l2 && working_set > l2) {
+                std::cout << " (exceeds " << double(l2)/1024.0 << "KiB L2 cache)";
+            } else if (l2) {
+                std::cout << " (fits in " << double(l2)/1024.0 << "KiB L2 cache)";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    // index of the context that message i is processed with
+    size_t context_for(corpus const & input, size_t i) const {
+        return (connection_id_column ? input.connection(i) : i) % connections;
+    }
+
+    // Print how the time to send a message divides between compressing it,
+    // which includes any reset and policy checks, and writing its frame
+    void print_pipeline() const {
+        double n = (messages == 0 ? 1.0 : double(messages));
+        double deflate_seconds = total_elapsed_seconds - total_header_seconds 
+            - total_mask_seconds;
+        double total = (total_elapsed_seconds > 0 ? total_elapsed_seconds : 1.0);
+
+        std::cout << std::left << std::setw(32) << "Send pipeline per message: " 
+                  << "deflate " << deflate_seconds*1000000.0/n << "us (" 
+                  << deflate_seconds/total*100.0 << "%), masking " 
+                  << total_mask_seconds*1000000.0/n << "us (" 
+                  << total_mask_seconds/total*100.0 << "%), header " 
+                  << total_header_seconds*1000000.0/n << "us (" 
+                  << total_header_seconds/total*100.0 << "%)" << std::endl;
+    }
+
+    // Print the cost of validating inflated text messages next to the time
+    // spent inflating them, which includes any reset
+    void print_validation() const {
+        double n = double(std::max<size_t>(1, validated_messages));
+        double inflate_seconds = total_elapsed_seconds - total_validate_seconds;
+        double total = (total_elapsed_seconds > 0 ? total_elapsed_seconds : 1.0);
+
+        std::cout << std::left << std::setw(32) << "Validated text messages: " 
+                  << validated_messages << " (" << invalid_utf8_messages 
+                  << " not valid UTF-8)" << std::endl;
+        std::cout << std::left << std::setw(32) << "Receive time per message: " 
+                  << "inflate " << inflate_seconds*1000000.0/double(std::max<size_t>(1, messages)) 
+                  << "us (" 
+                  << inflate_seconds/total*100.0 << "%), UTF-8 " 
+                  << total_validate_seconds*1000000.0/n << "us (" 
+                  << total_validate_seconds/total*100.0 << "%)" << std::endl;
+        std::cout << std::left << std::setw(32) << "Scalar UTF-8 per message: " 
+                  << total_validate_scalar_seconds*1000000.0/n << "us (" 
+                  << (total_validate_seconds > 0 
+                      ? total_validate_scalar_seconds/total_validate_seconds : 0.0)
+                  << "x the fast validator)" << std::endl;
+    }
+
+    // Print what sending messages in fragments of at most max_frame_size
+    // bytes costs on the wire and gains in latency and buffer memory
+    void print_fragmentation() const {
+        size_t wire = total_compressed_size + total_frame_overhead_compressed;
+
+        std::cout << std::left << std::setw(32) << "Frames sent: " << total_fragments 
+                  << " (" << double(total_fragments)/double(std::max<size_t>(1, messages))
+                  << " per message)" << std::endl;
+        std::cout << std::left << std::setw(32) << "Extra frame overhead: " 
+                  << total_fragment_overhead << "B (" 
+                  << (wire == 0 ? 0.0 : double(total_fragment_overhead)/double(wire)*100.0)
+                  << "% of wire bytes)" << std::endl;
+        std::cout << std::left << std::setw(32) << "Fragment p50/p90/p99/p99.9/max: ";
+        print_percentiles(fragment_latency);
+        std::cout << std::endl;
+        std::cout << std::left << std::setw(32) << "TTFB p50/p90/p99/p99.9/max: ";
+        print_percentiles(first_byte_latency);
+        std::cout << std::endl;
+        std::cout << std::left << std::setw(32) << "Peak output buffer: " 
+                  << double(output_buffer_peak)/1024.0 << "KiB vs " 
+                  << double(output_buffer_whole)/1024.0 
+                  << "KiB to compress the largest message in one go" << std::endl;
+    }
+
+    // Print the spread of throughput between repetitions and flag runs that
+    // suggest the measurements are disturbed by something outside the test
+    void print_repetitions() const {
+        std::cout << std::left << std::setw(32) << "Repetitions: " 
+                  << repetition_throughput.size() << " (after " << warmup 
+                  << " warm up), stats above are from the median run" << std::endl;
+        std::cout << std::left << std::setw(32) << "Throughput mean +/- 95% CI: " 
+                  << throughput_mean << " +/- " << throughput_ci95 << "MB/s (stddev " 
+                  << throughput_stddev << ")" << std::endl;
+
+        for (size_t i = 0; i < repetition_throughput.size(); i++) {
+            if (std::abs(repetition_throughput[i]-throughput_mean) > 2*throughput_stddev) {
+                std::cout << "  Repetition " << i+1 << " is an outlier at " 
+                          << repetition_throughput[i] << "MB/s" << std::endl;
+            }
+        }
+
+        double cv = throughput_stddev/throughput_mean;
+        if (cv > 0.05) {
+            std::cout << "  Warning: throughput varies by " << cv*100.0 << "% between "
+                      << "repetitions. CPU frequency scaling or other load on this "
+                      << "machine may be distorting the results." << std::endl;
+        }
+    }
+
+    // print hardware counter totals as IPC and events per KB of payload
+    void print_counters() const {
+        if (!counter_error.empty()) {
+            std::cout << std::left << std::setw(32) << "Hardware counters: " 
+                      << "unavailable (" << counter_error << ")" << std::endl;
+            return;
+        }
+
+        double kb = double(total_payload)/1000.0;
+
+        if (counter_available[perf_counters::cycles] && 
+            counter_available[perf_counters::instructions]) 
+        {
+            std::cout << std::left << std::setw(32) << "Instructions per cycle: " 
+                      << double(counter_totals[perf_counters::instructions]) / 
+                         double(counter_totals[perf_counters::cycles]) 
+                      << " (" << double(counter_totals[perf_counters::cycles])/kb 
+                      << " cycles/KB)" << std::endl;
+        }
+
+        for (size_t i = perf_counters::l1d_misses; i < perf_counter_count; i++) {
+            std::string label = std::string(perf_counter_names[i]) + " per KB: ";
+            label[0] = char(toupper(label[0]));
+            std::cout << std::left << std::setw(32) << label;
+            if (counter_available[i]) {
+                std::cout << double(counter_totals[i])/kb;
+            } else {
+                std::cout << "not supported";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    // print the p50/p90/p99/p99.9/max of a latency histogram in microseconds
+    static void print_percentiles(hdr_histogram const & h) {
+        double const quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        for (double q : quantiles) {
+            std::cout << double(h.value_at_quantile(q))/1000.0 << " / ";
+        }
+        std::cout << double(h.max())/1000.0 << "us";
+    }
+
+    // Write the latency histogram to histogram_file in microseconds. Returns
+    // false and prints an error if the file cannot be written.
+    bool write_histogram() const {
+        std::ofstream out(histogram_file.c_str());
+        latency_histogram.write_percentiles(out, 1000.0);
+
+        if (!out) {
+            std::cout << "Unable to write " << histogram_file << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Write every line_result to dump_file as CSV. Returns false and prints an
+    // error if the file cannot be written.
+    bool write_dump() const {
+        std::ofstream out(dump_file.c_str());
+        out << "message,payload_size,compressed_size,frame_overhead,"
+            << "frame_overhead_compressed,ratio,elapsed_us,compressed";
+        if (perf_counters) {
+            out << ",cycles,instructions,l1d_misses,llc_misses,branch_misses";
+        }
+        out << "\n";
+
+        for (size_t i = 0; i < line_results.size(); i++) {
+            line_result const & lr = line_results[i];
+            out << i << "," << lr.payload_size << "," << lr.compressed_size << ","
+                << lr.frame_overhead << "," << lr.frame_overhead_compressed << ","
+                << lr.ratio << "," << lr.elapsed_seconds*1000000.0 << ","
+                << (lr.compressed ? 1 : 0);
+            if (perf_counters) {
+                for (size_t j = 0; j < perf_counter_count; j++) {
+                    out << "," << lr.counters[j];
+                }
+            }
+            out << "\n";
+        }
+
+        if (!out) {
+            std::cout << "Unable to write " << dump_file << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // measured steady state memory of the context this test simulates
+    size_t context_memory() const {
+        return (sending ? deflate_memory.steady : inflate_memory.steady);
+    }
+
+    double cpu_seconds_per_mb() const {
+        return total_elapsed_seconds / (double(total_payload)/1000000.0);
+    }
+
+    // The permessage-deflate extension parameters that would have to be
+    // negotiated for the remote endpoint to accept this configuration. The
+    // parameters name the endpoint doing the compression.
+    std::string extension_offer() const {
+        std::string prefix = (is_server == sending ? "server_" : "client_");
+        std::string offer = "permessage-deflate";
+
+        if (!context_takeover) {
+            offer += "; " + prefix + "no_context_takeover";
+        }
+        if (window_bits < 15) {
+            std::ostringstream ss;
+            ss << "; " << prefix << "max_window_bits=" << window_bits;
+            offer += ss.str();
+        }
+        return offer;
+    }
+
+    static void print_summary_header() {
+        std::cout << std::left 
+                  << std::setw(8) << "conns"
+                  << std::setw(10) << "takeover"
+                  << std::setw(7) << "speed"
+                  << std::setw(7) << "window"
+                  << std::setw(7) << "memory"
+                  << std::setw(14) << "strategy"
+                  << std::setw(12) << "ratio"
+                  << std::setw(16) << "compressed(KB)"
+                  << std::setw(14) << "elapsed(ms)"
+                  << std::setw(12) << "MB/s"
+                  << std::setw(10) << "+/-95%"
+                  << std::setw(12) << "p99(us)"
+                  << std::setw(12) << "state(KiB)"
+                  << std::endl;
+    }
+
+    // print a single row summarizing this test. calc_stats must have been called
+    void print_summary_row() const {
+        std::cout << std::left 
+                  << std::setw(8) << connections
+                  << std::setw(10) << (context_takeover ? "true" : "false")
+                  << std::setw(7) << speed_level
+                  << std::setw(7) << window_bits
+                  << std::setw(7) << memory_level
+                  << std::setw(14) << (strategy >= 0 && strategy < strategy_count 
+                                       ? strategy_names[strategy] : "?");
+
+        if (error) {
+            std::cout << "error" << std::endl;
+            return;
+        }
+
+        std::cout << std::setw(12) << total_ratio
+                  << std::setw(16) << double(total_compressed_size)/1000.0
+                  << std::setw(14) << total_elapsed_seconds*1000.0
+                  << std::setw(12) << throughput_mean
+                  << std::setw(10) << throughput_ci95
+                  << std::setw(12) << p99_elapsed_seconds*1000000.0
+                  << std::setw(12) << double(context_memory())/1024.0
+                  << std::endl;
+    }
+};
+
+// Times messages and records their results in a test_result. Call start()
+// and stop() immediately around the code being timed, then record() with the
+// message's result. Results of messages that are not timed are passed to
+// record_untimed() so that results stay in input order. With a timing batch
+// of more than one message, results are held back until the batch completes
+// and its time can be split between them; call flush() once at the end.
+class message_timer {
+public:
+    explicit message_timer(test_result & r) : m_result(r), m_start(0), m_elapsed(0), 
+        m_timed(0), m_batch_complete(false)
+    {
+        m_result.clock_overhead_seconds = message_clock::to_seconds(message_clock::overhead());
+    }
+
+    void start() {
+        if (m_timed == 0) {
+            m_start = message_clock::start();
+        }
+    }
+
+    void stop() {
+        if (++m_timed == WSPMCE_TIMING_BATCH) {
+            m_elapsed = elapsed(message_clock::stop());
+            m_batch_complete = true;
+        }
+    }
+
+    void record(line_result const & lr) {
+        if (WSPMCE_TIMING_BATCH == 1) {
+            line_result timed = lr;
+            timed.elapsed_seconds = message_clock::to_seconds(m_elapsed);
+            m_timed = 0;
+            m_result.record(timed);
+            return;
+        }
+
+        m_pending.push_back(std::make_pair(lr, true));
+        if (m_batch_complete) {
+            complete_batch();
+        }
+    }
+
+    void record_untimed(line_result const & lr) {
+        if (m_pending.empty()) {
+            m_result.record(lr);
+        } else {
+            m_pending.push_back(std::make_pair(lr, false));
+        }
+    }
+
+    // end a partial batch and record its results
+    void flush() {
+        if (m_timed > 0 && !m_batch_complete) {
+            m_elapsed = elapsed(message_clock::stop());
+        }
+        complete_batch();
+    }
+private:
+    message_clock::ticks elapsed(message_clock::ticks end) const {
+        message_clock::ticks t = end - m_start;
+        return (t > message_clock::overhead() ? t - message_clock::overhead() : 0);
+    }
+
+    // split the batch's time between its timed messages by payload size
+    void complete_batch() {
+        double weight = 0;
+        size_t timed = 0;
+        for (auto const & p : m_pending) {
+            if (p.second) {
+                weight += double(p.first.payload_size);
+                timed++;
+            }
+        }
+
+        double seconds = message_clock::to_seconds(m_elapsed);
+        for (auto & p : m_pending) {
+            if (p.second) {
+                p.first.elapsed_seconds = (weight > 0 ? 
+                    seconds*double(p.first.payload_size)/weight : seconds/double(timed));
+            }
+            m_result.record(p.first);
+        }
+
+        m_pending.clear();
+        m_timed = 0;
+        m_elapsed = 0;
+        m_batch_complete = false;
+    }
+
+    test_result & m_result;
+    message_clock::ticks m_start;
+    message_clock::ticks m_elapsed;
+    size_t m_timed;
+    bool m_batch_complete;
+    std::vector<std::pair<line_result,bool>> m_pending;
+};
+
+// zlib 1.2.9 and later refuse to produce raw deflate streams with an 8 bit
+// window. As in most permessage-deflate implementations a 9 bit window is used
+// in its place.
+int zlib_window_bits(int window_bits) {
+    return (window_bits == 8 ? 9 : window_bits);
+}
+
+// the 4 byte trailer that ends every sync flushed deflate block. permessage-deflate
+// strips it before writing a message on the wire and the receiver re-appends it
+// before inflation.
+const unsigned char deflate_trailer[4] = {0x00, 0x00, 0xff, 0xff};
+
+// Recovers WebSocket messages from a libpcap capture file. TCP streams are
+// reassembled per direction, the HTTP upgrade is skipped, RFC 6455 frames are
+// unmasked and joined into messages, and messages sent with RSV1 set are
+// inflated. Recovered messages are appended to a corpus with one connection id
+// per TCP direction so that each is tested with its own context.
+class pcap_reader {
+public:
+    // number of packets, connections and messages seen while reading
+    struct stats {
+        size_t packets = 0;
+        size_t connections = 0;
+        size_t messages = 0;
+        size_t inflate_errors = 0;
+        size_t protocol_errors = 0;
+    };
+
+    // server_messages selects messages sent by the server (or by the client)
+    pcap_reader(corpus & out, bool server_messages) 
+      : m_out(out), m_server_messages(server_messages), m_swapped(false), 
+        m_nanosecond(false), m_linktype(0) {}
+
+    // Returns false and prints an error if the file is not a pcap capture. The
+    // capture is mapped rather than read, so only the messages recovered from
+    // it take up memory.
+    bool read(std::string const & path) {
+        file_mapping data;
+        if (!data.map(path)) {
+            return false;
+        }
+        unsigned char const * buf = reinterpret_cast<unsigned char const *>(data.data());
+
+        if (data.size() < 24 || !read_header(buf)) {
+            std::cout << path << " is not a libpcap capture file (pcapng is not supported)" 
+                      << std::endl;
+            return false;
+        }
+
+        size_t pos = 24;
+        while (pos+16 <= data.size()) {
+            uint64_t ts_sec = get32(buf+pos);
+            uint64_t ts_frac = get32(buf+pos+4);
+            size_t caplen = get32(buf+pos+8);
+            pos += 16;
+
+            if (caplen > data.size()-pos) {
+                break;
+            }
+
+            uint64_t timestamp = ts_sec*1000000 + (m_nanosecond ? ts_frac/1000 : ts_frac);
+            m_stats.packets++;
+            read_link(buf+pos, caplen, timestamp);
+            pos += caplen;
+        }
+        return true;
+    }
+
+    stats const & get_stats() const {
+        return m_stats;
+    }
+private:
+    // one direction of a TCP connection
+    struct stream {
+        enum state_type { http, frames, done };
+
+        // TCP reassembly
+        bool have_seq = false;
+        uint32_t next_seq = 0;
+        std::map<uint32_t,std::string> pending;
+        std::string buffer;
+        size_t consumed = 0;
+
+        // WebSocket state
+        state_type state = http;
+        bool websocket_request = false;
+        bool from_server = false;
+        bool in_message = false;
+        bool compressed = false;
+        unsigned char opcode = 0;
+        std::string message;
+        std::unique_ptr<z_stream> inflater;
+
+        ~stream() {
+            if (inflater) {
+                inflateEnd(inflater.get());
+            }
+        }
+    };
+
+    typedef std::string flow_key;
+
+    bool read_header(unsigned char const * buf) {
+        uint32_t magic = uint32_t(buf[0]) | uint32_t(buf[1]) << 8 
+                       | uint32_t(buf[2]) << 16 | uint32_t(buf[3]) << 24;
+
+        if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+            m_swapped = false;
+        } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+            m_swapped = true;
+        } else {
+            return false;
+        }
+        m_nanosecond = (magic == 0xa1b23c4d || magic == 0x4d3cb2a1);
+        m_linktype = get32(buf+20) & 0x0fffffff;
+        return true;
+    }
+
+    // little endian pcap header field, byte swapped if the file was written
+    // on a big endian host
+    uint32_t get32(unsigned char const * p) const {
+        if (m_swapped) {
+            return uint32_t(p[3]) | uint32_t(p[2]) << 8 | uint32_t(p[1]) << 16 | uint32_t(p[0]) << 24;
+        }
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    }
+
+    static uint32_t be16(unsigned char const * p) {
+        return uint32_t(p[0]) << 8 | uint32_t(p[1]);
+    }
+
+    static uint32_t be32(unsigned char const * p) {
+        return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+    }
+
+    void read_link(unsigned char const * p, size_t len, uint64_t timestamp) {
+        switch (m_linktype) {
+            case 0: // BSD loopback, address family in host byte order
+                if (len >= 4) {
+                    read_ip(p+4, len-4, timestamp);
+                }
+                break;
+            case 1: { // Ethernet, possibly with VLAN tags
+                size_t off = 12;
+                while (off+2 <= len && (be16(p+off) == 0x8100 || be16(p+off) == 0x88a8)) {
+                    off += 4;
+                }
+                if (off+2 <= len && (be16(p+off) == 0x0800 || be16(p+off) == 0x86dd)) {
+                    read_ip(p+off+2, len-off-2, timestamp);
+                }
+                break;
+            }
+            case 12:
+            case 14:
+            case 101: // raw IP
+            case 228:
+            case 229:
+                read_ip(p, len, timestamp);
+                break;
+            case 113: // Linux cooked capture
+                if (len >= 16) {
+                    read_ip(p+16, len-16, timestamp);
+                }
+                break;
+            case 276: // Linux cooked capture v2
+                if (len >= 20) {
+                    read_ip(p+20, len-20, timestamp);
+                }
+                break;
+        }
+    }
+
+    void read_ip(unsigned char const * p, size_t len, uint64_t timestamp) {
+        if (len < 1) {
+            return;
+        }
+
+        int version = p[0] >> 4;
+        if (version == 4 && len >= 20) {
+            size_t header = size_t(p[0] & 0x0f)*4;
+            size_t total = be16(p+2);
+            bool fragment = (be16(p+6) & 0x3fff) != 0;
+
+            if (p[9] != 6 || fragment || header < 20 || total < header || total > len) {
+                return;
+            }
+            read_tcp(flow_key(reinterpret_cast<char const *>(p+12), 8), p+header, 
+                total-header, timestamp);
+        } else if (version == 6 && len >= 40) {
+            size_t total = be16(p+4)+40;
+
+            // extension headers are not followed
+            if (p[6] != 6 || total > len) {
+                return;
+            }
+            read_tcp(flow_key(reinterpret_cast<char const *>(p+8), 32), p+40, 
+                total-40, timestamp);
+        }
+    }
+
+    void read_tcp(flow_key addresses, unsigned char const * p, size_t len, uint64_t timestamp) {
+        if (len < 20) {
+            return;
+        }
+
+        size_t header = size_t(p[12] >> 4)*4;
+        if (header < 20 || header > len) {
+            return;
+        }
+
+        uint32_t seq = be32(p+4);
+        bool syn = (p[13] & 0x02) != 0;
+
+        // the source address and port followed by the destination address and
+        // port identify one direction of the connection
+        size_t half = addresses.size()/2;
+        flow_key key = addresses.substr(0,half) + std::string(reinterpret_cast<char const *>(p), 2)
+                     + addresses.substr(half) + std::string(reinterpret_cast<char const *>(p+2), 2);
+
+        std::unique_ptr<stream> & s = m_streams[key];
+        if (!s) {
+            s.reset(new stream());
+        }
+
+        if (syn) {
+            s->have_seq = true;
+            s->next_seq = seq+1;
+            return;
+        }
+
+        if (len == header || s->state == stream::done) {
+            return;
+        }
+
+        if (!s->have_seq) {
+            s->have_seq = true;
+            s->next_seq = seq;
+        }
+
+        std::string segment(reinterpret_cast<char const *>(p+header), len-header);
+        if (int32_t(seq - s->next_seq) > 0) {
+            s->pending[seq] = segment;
+            return;
+        }
+        append(*s, seq, segment);
+
+        // drain any out of order segments that are now contiguous
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            for (auto it = s->pending.begin(); it != s->pending.end(); ++it) {
+                if (int32_t(it->first - s->next_seq) <= 0) {
+                    append(*s, it->first, it->second);
+                    s->pending.erase(it);
+                    progress = true;
+                    break;
+                }
+            }
+        }
+
+        read_stream(*s, timestamp);
+    }
+
+    // append a segment starting at or before the next expected sequence number,
+    // discarding any bytes already received
+    void append(stream & s, uint32_t seq, std::string const & segment) {
+        size_t overlap = size_t(s.next_seq - seq);
+        if (overlap >= segment.size()) {
+            return;
+        }
+        s.buffer.append(segment, overlap, std::string::npos);
+        s.next_seq += uint32_t(segment.size()-overlap);
+    }
+
+    void read_stream(stream & s, uint64_t timestamp) {
+        if (s.state == stream::http) {
+            size_t end = s.buffer.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                if (s.buffer.size() > 65536) {
+                    s.state = stream::done;
+                }
+                return;
+            }
+
+            std::string headers = s.buffer.substr(0,end);
+            std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+
+            if (headers.compare(0,4,"get ") == 0 && headers.find("websocket") != std::string::npos) {
+                s.from_server = false;
+            } else if (headers.compare(0,12,"http/1.1 101") == 0) {
+                s.from_server = true;
+            } else {
+                s.state = stream::done;
+                return;
+            }
+
+            s.state = stream::frames;
+            s.consumed = end+4;
+        }
+
+        while (s.state == stream::frames && read_frame(s, timestamp)) {}
+
+        if (s.consumed > 65536 || s.consumed == s.buffer.size()) {
+            s.buffer.erase(0, s.consumed);
+            s.consumed = 0;
+        }
+    }
+
+    // parse one complete frame from the stream buffer. Returns false if more
+    // data is needed.
+    bool read_frame(stream & s, uint64_t timestamp) {
+        unsigned char const * p = reinterpret_cast<unsigned char const *>(s.buffer.data())+s.consumed;
+        size_t avail = s.buffer.size()-s.consumed;
+
+        if (avail < 2) {
+            return false;
+        }
+
+        bool fin = (p[0] & 0x80) != 0;
+        bool rsv1 = (p[0] & 0x40) != 0;
+        unsigned char opcode = p[0] & 0x0f;
+        bool masked = (p[1] & 0x80) != 0;
+        uint64_t length = p[1] & 0x7f;
+        size_t header = 2;
+
+        if (length == 126) {
+            if (avail < 4) {
+                return false;
+            }
+            length = be16(p+2);
+            header = 4;
+        } else if (length == 127) {
+            if (avail < 10) {
+                return false;
+            }
+            length = uint64_t(be32(p+2)) << 32 | be32(p+6);
+            header = 10;
+        }
+
+        size_t mask_offset = header;
+        if (masked) {
+            header += 4;
+        }
+        if (avail < header || length > avail-header) {
+            return false;
+        }
+
+        std::string payload(reinterpret_cast<char const *>(p+header), size_t(length));
+        if (masked) {
+            unsigned char * data = reinterpret_cast<unsigned char *>(&payload[0]);
+            mask_payload_fast(data, data, payload.size(), p+mask_offset);
+        }
+        s.consumed += header+size_t(length);
+
+        if (opcode >= 0x8) {
+            if (opcode == 0x8) {
+                s.state = stream::done;
+            }
+            return true;
+        }
+
+        if (opcode == 0x0) {
+            if (!s.in_message) {
+                m_stats.protocol_errors++;
+                s.state = stream::done;
+                return false;
+            }
+        } else if (opcode == opcode_text || opcode == opcode_binary) {
+            s.in_message = true;
+            s.compressed = rsv1;
+            s.opcode = opcode;
+            s.message.clear();
+        } else {
+            m_stats.protocol_errors++;
+            s.state = stream::done;
+            return false;
+        }
+
+        s.message += payload;
+
+        if (fin) {
+            s.in_message = false;
+            finish_message(s, timestamp);
+        }
+        return true;
+    }
+
+    void finish_message(stream & s, uint64_t timestamp) {
+        if (s.from_server != m_server_messages) {
+            return;
+        }
+
+        if (s.compressed && !inflate_message(s)) {
+            m_stats.inflate_errors++;
+            return;
+        }
+
+        // connection ids are assigned in order of first message
+        auto id = m_connection_ids.insert(std::make_pair(&s, m_connection_ids.size()));
+        m_stats.connections = m_connection_ids.size();
+        m_stats.messages++;
+
+        m_out.append(reinterpret_cast<unsigned char const *>(s.message.data()), 
+            s.message.size(), id.first->second, s.opcode, timestamp);
+    }
+
+    // Inflate the message in place. A window of 15 bits inflates streams
+    // compressed with any negotiated window size, and a persistent context
+    // inflates streams sent with or without context takeover.
+    bool inflate_message(stream & s) {
+        if (!s.inflater) {
+            s.inflater.reset(new z_stream());
+            s.inflater->zalloc = Z_NULL;
+            s.inflater->zfree = Z_NULL;
+            s.inflater->opaque = Z_NULL;
+            if (inflateInit2(s.inflater.get(), -15) != Z_OK) {
+                s.inflater.reset();
+                return false;
+            }
+        }
+
+        s.message.append(reinterpret_cast<char const *>(deflate_trailer), sizeof(deflate_trailer));
+
+        z_stream & zs = *s.inflater;
+        zs.next_in = reinterpret_cast<unsigned char *>(&s.message[0]);
+        zs.avail_in = s.message.size();
+
+        std::string out;
+        unsigned char chunk[16384];
+        int ret;
+        do {
+            zs.next_out = chunk;
+            zs.avail_out = sizeof(chunk);
+            ret = inflate(&zs, Z_SYNC_FLUSH);
+            out.append(reinterpret_cast<char *>(chunk), sizeof(chunk)-zs.avail_out);
+        } while (ret == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0));
+
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            // the context is now unusable, start over for the next message
+            inflateEnd(&zs);
+            s.inflater.reset();
+            return false;
+        }
+
+        s.message.swap(out);
+        return true;
+    }
+
+    corpus & m_out;
+    bool m_server_messages;
+    bool m_swapped;
+    bool m_nanosecond;
+    uint32_t m_linktype;
+    std::map<flow_key,std::unique_ptr<stream>> m_streams;
+    std::map<stream const *,size_t> m_connection_ids;
+    stats m_stats;
+};
+
+// A deflate or inflate context with its own allocation accounting. zlib keeps a
+// pointer back to the z_stream, so contexts may be neither copied nor moved.
+class zlib_context {
+public:
+    // deflate sets the direction of a context that is first set up by reinit
+    explicit zlib_context(bool deflate = false) : m_state(), m_deflate(deflate), 
+        m_initialized(false)
+    {
+        init_zlib_allocator(m_state, m_memory);
+        m_state.avail_in = 0;
+        m_state.next_in = Z_NULL;
+    }
+
+    ~zlib_context() {
+        end();
+    }
+
+    int init_deflate(test_result const & r) {
+        m_deflate = true;
+        int ret = deflateInit2(
+            &m_state,
+            r.speed_level,
+            Z_DEFLATED,
+            -1*zlib_window_bits(r.window_bits),
+            r.memory_level,
+            r.strategy
+        );
+        m_initialized = (ret == Z_OK);
+        m_dictionary = r.dictionary;
+        return (ret == Z_OK ? set_dictionary() : ret);
+    }
+
+    int init_inflate(test_result const & r) {
+        m_deflate = false;
+        int ret = inflateInit2(&m_state, -1*zlib_window_bits(r.window_bits));
+        m_initialized = (ret == Z_OK);
+        m_dictionary = r.dictionary;
+        return (ret == Z_OK ? set_dictionary() : ret);
+    }
+
+    // Replace this context with a copy of a deflate context, so that a message
+    // can be compressed on trial and the source rolled back if it is rejected
+    int copy_deflate(zlib_context & source) {
+        end();
+
+        size_t peak = source.m_memory.peak;
+        size_t before = source.m_memory.current;
+        int ret = deflateCopy(&m_state, &source.m_state);
+
+        // deflateCopy copies the allocator along with the stream, so the
+        // copy's memory was counted against the source. Move it across.
+        size_t bytes = source.m_memory.current - before;
+        source.m_memory.current = before;
+        source.m_memory.peak = peak;
+        m_state.opaque = &m_memory;
+        m_memory.current += bytes;
+        m_memory.peak = std::max(m_memory.peak, m_memory.current);
+
+        m_deflate = true;
+        m_initialized = (ret == Z_OK);
+        m_dictionary = source.m_dictionary;
+        return ret;
+    }
+
+    // free the context and set it up again from scratch
+    int reinit(test_result const & r) {
+        end();
+        return (m_deflate ? init_deflate(r) : init_inflate(r));
+    }
+
+    // return the context to its freshly initialized state, preset dictionary
+    // included, without freeing its memory
+    int reset() {
+        int ret = (m_deflate ? deflateReset(&m_state) : inflateReset(&m_state));
+        return (ret == Z_OK ? set_dictionary() : ret);
+    }
+
+    // free the context, recording the memory it held as its steady state. A
+    // context that was already freed holds none.
+    void end() {
+        if (!m_initialized) {
+            m_memory.steady = 0;
+            return;
+        }
+        m_memory.steady = m_memory.current;
+        if (m_deflate) {
+            deflateEnd(&m_state);
+        } else {
+            inflateEnd(&m_state);
+        }
+        m_initialized = false;
+    }
+
+    z_stream & stream() {
+        return m_state;
+    }
+
+    zlib_memory const & memory() const {
+        return m_memory;
+    }
+private:
+    zlib_context(zlib_context const &) = delete;
+    zlib_context & operator=(zlib_context const &) = delete;
+
+    // Raw inflate streams have no header announcing a dictionary, so both
+    // sides load it up front rather than waiting for Z_NEED_DICT.
+    int set_dictionary() {
+        if (!m_dictionary || m_dictionary->empty()) {
+            return Z_OK;
+        }
+        Bytef const * data = reinterpret_cast<Bytef const *>(m_dictionary->data());
+        uInt size = uInt(m_dictionary->size());
+        return (m_deflate ? deflateSetDictionary(&m_state, data, size)
+                          : inflateSetDictionary(&m_state, data, size));
+    }
+
+    z_stream m_state;
+    zlib_memory m_memory;
+    std::shared_ptr<std::string const> m_dictionary;
+    bool m_deflate;
+    bool m_initialized;
+};
+
+typedef std::vector<std::unique_ptr<zlib_context>> context_list;
+
+// set up one context per simulated connection. Prints an error and returns
+// false if zlib refuses the settings.
+bool init_contexts(context_list & contexts, test_result & r, bool deflate) {
+    contexts.clear();
+    for (size_t i = 0; i < r.connections; i++) {
+        contexts.push_back(std::unique_ptr<zlib_context>(new zlib_context()));
+
+        int ret = (deflate ? contexts.back()->init_deflate(r) 
+                           : contexts.back()->init_inflate(r));
+
+        if (ret != Z_OK) {
+            std::cout << "Fatal Error setting up " << (deflate ? "deflate" : "inflate")
+                      << " context" << std::endl;
+            r.error = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// free all contexts. Returns the combined memory they held.
+size_t end_contexts(context_list & contexts) {
+    size_t total = 0;
+    for (auto & c : contexts) {
+        c->end();
+        total += c->memory().steady;
+    }
+    return total;
+}
+
+// Open hardware counters for a test if it asks for them. Returns true if the
+// test should read them.
+bool open_counters(perf_counters & counters, test_result & r) {
+    if (!r.perf_counters) {
+        return false;
+    }
+    if (!counters.open(r.counter_error)) {
+        if (r.counter_error.empty()) {
+            r.counter_error = "unknown error";
+        }
+        return false;
+    }
+    for (size_t i = 0; i < perf_counter_count; i++) {
+        r.counter_available[i] = counters.available(i);
+    }
+    return true;
+}
+
+// Messages compressed by deflate_test for inflate_test, stored back to back in
+// a single buffer with the trailer already removed
+class compressed_messages {
+public:
+    compressed_messages() : m_ends(1, 0) {}
+
+    void append(unsigned char const * data, size_t size) {
+        m_data.append(reinterpret_cast<char const *>(data), size);
+        m_ends.push_back(m_data.size());
+        m_compressed.push_back(true);
+    }
+
+    // a message the compression policy sent as is
+    void append_uncompressed() {
+        m_ends.push_back(m_data.size());
+        m_compressed.push_back(false);
+    }
+
+    bool compressed(size_t i) const {
+        return m_compressed[i];
+    }
+
+    unsigned char const * data(size_t i) const {
+        return reinterpret_cast<unsigned char const *>(m_data.data())+m_ends[i];
+    }
+
+    size_t size(size_t i) const {
+        return m_ends[i+1]-m_ends[i];
+    }
+private:
+    std::string m_data;
+    std::vector<size_t> m_ends;
+    std::vector<bool> m_compressed;
+};
+
+// record a message as sent without compression
+void send_uncompressed(line_result & lr) {
+    lr.compressed = false;
+    lr.compressed_size = lr.payload_size;
+    lr.frame_overhead_compressed = lr.frame_overhead;
+    lr.ratio = 1.0;
+}
+
+// Order 0 entropy of a message in bits per byte. Near 8 for data that is
+// already compressed or encrypted, which deflate cannot shrink.
+double byte_entropy(unsigned char const * data, size_t size) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < size; i++) {
+        counts[data[i]]++;
+    }
+
+    double entropy = 0;
+    for (size_t c : counts) {
+        if (c > 0) {
+            double p = double(c)/double(size);
+            entropy -= p*std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+// Check that a text message is valid UTF-8 (RFC 3629) one code point at a
+// time: no overlong forms, surrogates or code points above U+10FFFF
+bool validate_utf8_scalar(unsigned char const * data, size_t size) {
+    size_t i = 0;
+    while (i < size) {
+        unsigned char c = data[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        size_t length;
+        unsigned char low = 0x80;
+        unsigned char high = 0xbf;
+        if (c >= 0xc2 && c <= 0xdf) {
+            length = 2;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            length = 3;
+            if (c == 0xe0) {
+                low = 0xa0;
+            } else if (c == 0xed) {
+                high = 0x9f;
+            }
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            length = 4;
+            if (c == 0xf0) {
+                low = 0x90;
+            } else if (c == 0xf4) {
+                high = 0x8f;
+            }
+        } else {
+            return false;
+        }
+
+        if (size - i < length || data[i+1] < low || data[i+1] > high) {
+            return false;
+        }
+        for (size_t j = 2; j < length; j++) {
+            if (data[i+j] < 0x80 || data[i+j] > 0xbf) {
+                return false;
+            }
+        }
+        i += length;
+    }
+    return true;
+}
+
+// States of the UTF-8 validation automaton. Other states are part way
+// through a multi byte sequence.
+const unsigned char utf8_accept = 0;
+const unsigned char utf8_reject = 1;
+
+// Next state for each state and byte class. Classes are: ASCII, 80-8F,
+// 90-9F, A0-BF, never valid, C2-DF, E0, E1-EC and EE-EF, ED, F0, F1-F3, F4.
+const unsigned char utf8_transitions[9][12] = {
+    {0, 1, 1, 1, 1, 2, 4, 3, 5, 6, 7, 8}, // accept
+    {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}, // reject
+    {1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1}, // one continuation byte left
+    {1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1}, // two left
+    {1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1}, // after E0, not overlong
+    {1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1}, // after ED, not a surrogate
+    {1, 1, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1}, // after F0, not overlong
+    {1, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1}, // three left
+    {1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}  // after F4, at most U+10FFFF
+};
+
+unsigned char const * utf8_classes() {
+    static unsigned char const * const classes = [] {
+        static unsigned char table[256];
+        for (int c = 0; c < 256; c++) {
+            table[c] = (c < 0x80 ? 0 : c < 0x90 ? 1 : c < 0xa0 ? 2 : c < 0xc0 ? 3
+                : c < 0xc2 ? 4 : c < 0xe0 ? 5 : c == 0xe0 ? 6 : c == 0xed ? 8
+                : c < 0xf0 ? 7 : c == 0xf0 ? 9 : c < 0xf4 ? 10 : c == 0xf4 ? 11 : 4);
+        }
+        return table;
+    }();
+    return classes;
+}
+
+// Same result as validate_utf8_scalar. Runs of ASCII are skipped 16 bytes
+// at a time with SSE2, or 8 elsewhere, and other bytes drive a table driven
+// automaton with no branches on the byte values.
+bool validate_utf8_fast(unsigned char const * data, size_t size) {
+    unsigned char const * classes = utf8_classes();
+    unsigned char state = utf8_accept;
+    size_t i = 0;
+
+    while (i < size) {
+        if (state == utf8_accept) {
+#if defined(__SSE2__)
+            while (i + 16 <= size && _mm_movemask_epi8(_mm_loadu_si128(
+                reinterpret_cast<__m128i const *>(data + i))) == 0)
+            {
+                i += 16;
+            }
+#endif
+            while (i + 8 <= size) {
+                uint64_t v;
+                std::memcpy(&v, data + i, 8);
+                if (v & 0x8080808080808080ULL) {
+                    break;
+                }
+                i += 8;
+            }
+            if (i == size) {
+                break;
+            }
+        }
+
+        state = utf8_transitions[state][classes[data[i]]];
+        if (state == utf8_reject) {
+            return false;
+        }
+        i++;
+    }
+    return state == utf8_accept;
+}
+
+// Run a UTF-8 validator, adding the time it took to seconds
+bool timed_utf8_check(bool (*validator)(unsigned char const *, size_t), 
+    unsigned char const * data, size_t size, double & seconds)
+{
+    message_clock::ticks start = message_clock::start();
+    bool valid = validator(data, size);
+    message_clock::ticks t = message_clock::stop() - start;
+
+    t = (t > message_clock::overhead() ? t - message_clock::overhead() : 0);
+    seconds += message_clock::to_seconds(t);
+    return valid;
+}
+
+// Restore a context before a message as the reset mode requires, recording
+// the time taken as the message's setup time
+int reset_context(zlib_context & context, test_result const & r, int reset_mode,
+    line_result & lr)
+{
+    message_clock::ticks start = message_clock::start();
+    int ret = (reset_mode == reset_mode_reinit ? context.reinit(r) : context.reset());
+    message_clock::ticks t = message_clock::stop() - start;
+
+    t = (t > message_clock::overhead() ? t - message_clock::overhead() : 0);
+    lr.setup_seconds = message_clock::to_seconds(t);
+    return ret;
+}
+
+// Writes the frames an endpoint would put on the wire for each message sent.
+// A client chooses a new masking key for every frame and writes a masked copy
+// of the payload after the header. A server's payload is sent from where it
+// is, so only the header is built. The time taken by each step is added to
+// the message's result.
+class frame_writer {
+public:
+    explicit frame_writer(bool masked) : m_masked(masked), m_key_state(0x2545f491) {}
+
+    void write(bool fin, unsigned char opcode, bool rsv1, unsigned char const * payload, 
+        size_t size, line_result & lr)
+    {
+        m_buf.resize(max_frame_header + (m_masked ? size : 0));
+
+        message_clock::ticks start = message_clock::start();
+        unsigned char key[4];
+        if (m_masked) {
+            next_key(key);
+        }
+        size_t header = write_frame_header(m_buf.data(), fin, opcode, rsv1, size, 
+            m_masked, key);
+        message_clock::ticks built = message_clock::stop();
+        if (m_masked) {
+            mask_payload_fast(m_buf.data()+header, payload, size, key);
+        }
+        message_clock::ticks masked = message_clock::stop();
+
+        m_buf.set_cursor(header + (m_masked ? size : 0));
+        lr.header_seconds += seconds(built - start);
+        lr.mask_seconds += (m_masked ? seconds(masked - built) : 0.0);
+    }
+
+    // the last frame written, or only its header for a server
+    unsigned char * data() {
+        return m_buf.data();
+    }
+
+    size_t size() const {
+        return m_buf.cursor();
+    }
+private:
+    // Masking keys must be unpredictable. A cheap xorshift generator stands in
+    // for the random source a real client would draw them from.
+    void next_key(unsigned char * key) {
+        m_key_state ^= m_key_state << 13;
+        m_key_state ^= m_key_state >> 17;
+        m_key_state ^= m_key_state << 5;
+        std::memcpy(key, &m_key_state, 4);
+    }
+
+    static double seconds(message_clock::ticks t) {
+        return message_clock::to_seconds(
+            t > message_clock::overhead() ? t - message_clock::overhead() : 0);
+    }
+
+    bool m_masked;
+    uint32_t m_key_state;
+    pod_buffer m_buf;
+};
+
+// Sends messages in frames of at most max_frame_size bytes of payload, as a
+// sender that streams its output instead of buffering whole messages would.
+// Input is deflated with Z_NO_FLUSH into a buffer that holds one fragment and
+// the trailer, and a fragment is sent each time the buffer fills. The message
+// ends with the sender's flush and the trailer is left off its last fragment.
+// The time taken to get each fragment ready is recorded, and for the first
+// fragment measured from start() is the message's time to first byte.
+class fragmenter {
+public:
+    fragmenter(test_result & r, frame_writer & frames) : m_result(r), m_frames(frames),
+        m_start(0), m_lr(nullptr), m_copy(nullptr), m_opcode(opcode_text),
+        m_rsv1(false)
+    {}
+
+    // call as the message's timing starts
+    void start() {
+        m_sent.clear();
+        m_start = message_clock::start();
+    }
+
+    // Record the time to each fragment of the message, and to its first, in
+    // the results. Call once the message's timing has stopped, so that
+    // updating the histograms is not counted as compression.
+    void record() {
+        message_clock::ticks last = m_start;
+        for (message_clock::ticks sent : m_sent) {
+            m_result.fragment_latency.record(nanoseconds(sent - last));
+            last = sent;
+        }
+        if (!m_sent.empty()) {
+            m_result.first_byte_latency.record(nanoseconds(m_sent.front() - m_start));
+        }
+    }
+
+    // Compress the input set in zlib_state, ending with flush. Fragments are
+    // also appended to copy unless it is null. Returns the deflate status.
+    int deflate_message(z_stream & zlib_state, int flush, unsigned char opcode, 
+        line_result & lr, std::string * copy)
+    {
+        size_t max = m_result.max_frame_size;
+        // Messages that compress to less than a fragment need no more room
+        // than when sent whole. zlib may write a flush marker again and again
+        // if a flush is continued with 6 bytes of output space or less, so
+        // there is room for more than that after a fragment and the trailer.
+        size_t bound = deflateBound(&zlib_state, zlib_state.avail_in) + 8;
+        m_buf.resize(std::min(max, bound) + sizeof(deflate_trailer) + 8);
+        begin(opcode, true, lr, copy);
+
+        size_t pending = 0;
+        int mode = Z_NO_FLUSH;
+        int ret;
+        for (;;) {
+            zlib_state.next_out = m_buf.data() + pending;
+            zlib_state.avail_out = m_buf.capacity() - pending;
+            ret = deflate(&zlib_state, mode);
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                return ret;
+            }
+            pending = m_buf.capacity() - zlib_state.avail_out;
+
+            if (mode == Z_NO_FLUSH) {
+                while (pending >= max) {
+                    send_front(max, pending);
+                }
+                if (zlib_state.avail_in == 0) {
+                    mode = flush;
+                }
+                continue;
+            }
+
+            // the last bytes written may be the trailer, which is not sent
+            while (pending > max + sizeof(deflate_trailer)) {
+                send_front(max, pending);
+            }
+            if (zlib_state.avail_out > 0) {
+                break;
+            }
+        }
+
+        send(m_buf.data(), pending - sizeof(deflate_trailer), true);
+        return ret;
+    }
+
+    // send a message without compression
+    void send_uncompressed(unsigned char const * data, size_t size, unsigned char opcode,
+        line_result & lr)
+    {
+        size_t max = m_result.max_frame_size;
+        begin(opcode, false, lr, nullptr);
+        do {
+            size_t n = std::min(size, max);
+            send(data, n, n == size);
+            data += n;
+            size -= n;
+        } while (size > 0);
+    }
+
+    size_t buffer_size() const {
+        return m_buf.capacity();
+    }
+private:
+    void begin(unsigned char opcode, bool rsv1, line_result & lr, std::string * copy) {
+        m_opcode = opcode;
+        m_rsv1 = rsv1;
+        m_lr = &lr;
+        m_copy = copy;
+        lr.fragments = 0;
+        lr.compressed_size = 0;
+        lr.frame_overhead_compressed = 0;
+    }
+
+    // send size bytes from the front of the buffer and keep the rest
+    void send_front(size_t size, size_t & pending) {
+        send(m_buf.data(), size, false);
+        std::memmove(m_buf.data(), m_buf.data()+size, pending-size);
+        pending -= size;
+    }
+
+    // RSV1 and the message's opcode are only set on its first frame
+    void send(unsigned char const * data, size_t size, bool fin) {
+        bool first = (m_lr->fragments == 0);
+        if (m_result.frames) {
+            m_frames.write(fin, (first ? m_opcode : opcode_continuation), first && m_rsv1,
+                data, size, *m_lr);
+        }
+        if (m_copy) {
+            m_copy->append(reinterpret_cast<char const *>(data), size);
+        }
+        m_lr->fragments++;
+        m_lr->compressed_size += size;
+        m_lr->frame_overhead_compressed += frame_overhead(!m_result.is_server, size);
+
+        // only allocates when a message has more fragments than any before it
+        m_sent.push_back(message_clock::stop());
+    }
+
+    static uint64_t nanoseconds(message_clock::ticks t) {
+        t = (t > message_clock::overhead() ? t - message_clock::overhead() : 0);
+        return uint64_t(message_clock::to_seconds(t)*1000000000.0+0.5);
+    }
+
+    test_result & m_result;
+    frame_writer & m_frames;
+    pod_buffer m_buf;
+    message_clock::ticks m_start;
+    std::vector<message_clock::ticks> m_sent;
+    line_result * m_lr;
+    std::string * m_copy;
+    unsigned char m_opcode;
+    bool m_rsv1;
+};
+
+// inflate a set of messages previously compressed by deflate_test, timing each one
+test_result inflate_test(corpus const & input, compressed_messages const & compressed, 
+    test_result r)
+{
+    context_list contexts;
+    pod_buffer in_buf;
+    pod_buffer out_buf;
+    message_timer timer(r);
+    perf_counters counters;
+    bool counting = open_counters(counters, r);
+
+    // One inflate context is kept per connection for both context takeover
+    // settings. When context takeover is disabled the sender's Z_FULL_FLUSH
+    // ensures that no message refers back to data from a previous one, unless
+    // the reset mode has both sides reset their contexts for every message.
+    if (!init_contexts(contexts, r, false)) {
+        return r;
+    }
+
+    int reset_mode = r.message_reset_mode();
+    if (r.validate_utf8) {
+        // build the byte class table before anything is timed
+        utf8_classes();
+    }
+
+    for (size_t i = 0; i < input.size(); i++) {
+        line_result lr;
+        lr.payload_size = input.size(i);
+        lr.frame_overhead = frame_overhead(!r.is_server,lr.payload_size);
+
+        if (!compressed.compressed(i)) {
+            send_uncompressed(lr);
+            timer.record_untimed(lr);
+            continue;
+        }
+
+        if (lr.payload_size == 0) {
+            // compressed value will be 2 bytes
+            lr.compressed_size = 2;
+            lr.ratio = 2.0;
+            timer.record_untimed(lr);
+            continue;
+        }
+
+        zlib_context & context = *contexts[r.context_for(input, i)];
+        z_stream & zlib_state = context.stream();
+        size_t msg_size = compressed.size(i);
+
+        lr.compressed_size = msg_size;
+        lr.frame_overhead_compressed = frame_overhead(!r.is_server,lr.compressed_size);
+        lr.ratio = double(lr.compressed_size) / double(lr.payload_size);
+
+        in_buf.resize(msg_size+sizeof(deflate_trailer));
+        std::copy(compressed.data(i),compressed.data(i)+msg_size,in_buf.first_avail());
+        std::copy(deflate_trailer,deflate_trailer+sizeof(deflate_trailer),
+            in_buf.first_avail()+msg_size);
+
+        // one extra byte so that a message that inflates to more than its
+        // original size is detected rather than silently truncated
+        out_buf.resize(lr.payload_size+1);
+        out_buf.set_cursor(0);
+
+        zlib_state.avail_in = msg_size+sizeof(deflate_trailer);
+        zlib_state.next_in = in_buf.first_avail();
+        zlib_state.avail_out = out_buf.avail();
+        zlib_state.next_out = out_buf.first_avail();
+
+        if (counting) {
+            counters.start();
+        }
+        timer.start();
+
+        int ret = (reset_mode != reset_mode_full_flush 
+            ? reset_context(context, r, reset_mode, lr) : Z_OK);
+        if (ret == Z_OK) {
+            ret = inflate(&zlib_state, Z_SYNC_FLUSH);
+        }
+
+        bool validate = r.validate_utf8 && input.opcode(i) == opcode_text;
+        if (validate) {
+            lr.valid_utf8 = timed_utf8_check(validate_utf8_fast, out_buf.data(), 
+                out_buf.avail() - zlib_state.avail_out, lr.validate_seconds);
+        }
+
+        timer.stop();
+        if (counting) {
+            counters.stop(lr.counters);
+        }
+
+        out_buf.adv_cursor(out_buf.avail() - zlib_state.avail_out);
+
+        if (validate) {
+            lr.validated = true;
+            if (timed_utf8_check(validate_utf8_scalar, out_buf.data(), out_buf.cursor(),
+                lr.validate_scalar_seconds) != lr.valid_utf8) 
+            {
+                std::cout << "Fatal Error, UTF-8 validators disagree on message " << i << std::endl;
+                r.error = true;
+                break;
+            }
+        }
+
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || out_buf.cursor() != lr.payload_size) {
+            std::cout << "Fatal Error, inflated message " << i << " does not match the original." << std::endl;
+            r.error = true;
+            break;
+        }
+
+        timer.record(lr);
+    }
+
+    timer.flush();
+
+    r.working_set = end_contexts(contexts);
+    r.inflate_memory = contexts[0]->memory();
+    return r;
+}
+
+// Inflate a single message to measure the memory a decompression context settles
+// at. zlib allocates the inflate window lazily on the first output, after which
+// the context does not grow.
+void measure_inflate_memory(std::string const & msg, test_result & r) {
+    zlib_context context;
+    z_stream & zlib_state = context.stream();
+    pod_buffer in_buf;
+    unsigned char out[4096];
+
+    if (context.init_inflate(r) != Z_OK) {
+        return;
+    }
+
+    in_buf.resize(msg.size()+sizeof(deflate_trailer));
+    std::copy(msg.begin(),msg.end(),in_buf.first_avail());
+    std::copy(deflate_trailer,deflate_trailer+sizeof(deflate_trailer),
+        in_buf.first_avail()+msg.size());
+
+    zlib_state.avail_in = msg.size()+sizeof(deflate_trailer);
+    zlib_state.next_in = in_buf.first_avail();
+
+    int ret;
+    do {
+        zlib_state.avail_out = sizeof(out);
+        zlib_state.next_out = out;
+        ret = inflate(&zlib_state, Z_SYNC_FLUSH);
+    } while (ret == Z_OK && zlib_state.avail_in > 0);
+
+    context.end();
+    r.inflate_memory = context.memory();
+}
+
+// Tracks when each connection last used its deflate context so that contexts
+// idle for longer than the hibernation threshold can be freed, and adds up
+// the memory held over time with and without hibernation. Time is measured
+// in input timestamps for idle_timeout and in messages for idle_messages.
+class hibernation_tracker {
+public:
+    hibernation_tracker(corpus const & input, test_result const & r)
+      : m_input(input)
+      , m_by_time(r.idle_timeout > 0)
+      , m_threshold(m_by_time ? uint64_t(r.idle_timeout*1000000.0) : r.idle_messages)
+      , m_connections(r.connections)
+      , m_end(0)
+      , m_bytes(0)
+      , m_held(0)
+      , m_held_always(0)
+      , m_hibernations(0) {}
+
+    // Free context c if it has been idle for longer than the threshold when
+    // message i arrives. It is counted as held until the threshold passed.
+    void arrive(size_t i, size_t c, zlib_context & context) {
+        connection & s = m_connections[c];
+        uint64_t now = time(i);
+        m_end = std::max(m_end, now);
+
+        if (s.used && s.awake && now - s.last > m_threshold) {
+            m_bytes = std::max(m_bytes, context.memory().current);
+            m_held += double(s.last + m_threshold - s.since);
+            context.end();
+            s.awake = false;
+            m_hibernations++;
+        }
+    }
+
+    // true if context c must be set up again before it is used
+    bool asleep(size_t c) const {
+        return !m_connections[c].awake;
+    }
+
+    // message i was compressed with context c, which is now awake
+    void used(size_t i, size_t c) {
+        connection & s = m_connections[c];
+        uint64_t now = time(i);
+
+        if (!s.used) {
+            s.used = true;
+            s.first = now;
+            s.since = now;
+        }
+        if (!s.awake) {
+            s.awake = true;
+            s.since = now;
+        }
+        s.last = now;
+    }
+
+    // add the memory held by contexts still awake at the end of the input
+    // and store the totals in r
+    void finish(context_list const & contexts, test_result & r) {
+        for (size_t c = 0; c < m_connections.size(); c++) {
+            connection const & s = m_connections[c];
+            if (!s.used) {
+                continue;
+            }
+            if (s.awake) {
+                m_bytes = std::max(m_bytes, contexts[c]->memory().current);
+                m_held += double(std::min(s.last + m_threshold, m_end) - s.since);
+            }
+            m_held_always += double(m_end - s.first);
+        }
+
+        double unit = (m_by_time ? 0.000001 : 1.0);
+        r.hibernations = m_hibernations;
+        r.context_memory_time = m_held*double(m_bytes)*unit;
+        r.context_memory_time_always = m_held_always*double(m_bytes)*unit;
+    }
+private:
+    struct connection {
+        bool used = false;
+        bool awake = true;
+        // first use, last wake up and last use
+        uint64_t first = 0;
+        uint64_t since = 0;
+        uint64_t last = 0;
+    };
+
+    uint64_t time(size_t i) const {
+        return (m_by_time ? m_input.timestamp(i) : i);
+    }
+
+    corpus const & m_input;
+    bool m_by_time;
+    uint64_t m_threshold;
+    std::vector<connection> m_connections;
+    uint64_t m_end;
+    size_t m_bytes;
+    double m_held;
+    double m_held_always;
+    size_t m_hibernations;
+};
+
+// Keeps at most capacity connections' contexts resident, evicting the least
+// recently used one to make room for a connection whose context is not
+class context_lru {
+public:
+    static size_t const none = size_t(-1);
+
+    // results of touch
+    static int const hit = 0;
+    static int const first_use = 1;
+    static int const miss = 2;
+
+    context_lru(size_t connections, size_t capacity)
+      : m_capacity(std::max<size_t>(1, capacity))
+      , m_position(connections)
+      , m_resident(connections, false)
+      , m_used(connections, false) {}
+
+    // Mark connection c's context as used by a message. Returns hit if it was
+    // resident. Otherwise it is made resident, evicted is set to the
+    // connection whose context must be freed to make room, or none, and
+    // first_use is returned for the connection's first message and miss for
+    // a context that was evicted before.
+    int touch(size_t c, size_t & evicted) {
+        evicted = none;
+        if (m_resident[c]) {
+            m_order.splice(m_order.begin(), m_order, m_position[c]);
+            return hit;
+        }
+
+        if (m_order.size() == m_capacity) {
+            evicted = m_order.back();
+            m_resident[evicted] = false;
+            m_order.pop_back();
+        }
+        m_order.push_front(c);
+        m_position[c] = m_order.begin();
+        m_resident[c] = true;
+
+        bool first = !m_used[c];
+        m_used[c] = true;
+        return (first ? first_use : miss);
+    }
+
+    size_t capacity() const {
+        return m_capacity;
+    }
+private:
+    size_t m_capacity;
+    // most recently used first
+    std::list<size_t> m_order;
+    std::vector<std::list<size_t>::iterator> m_position;
+    std::vector<bool> m_resident;
+    std::vector<bool> m_used;
+};
+
+// run a test
+test_result deflate_test(corpus const & input, test_result r) {
+    context_list contexts;
+    pod_buffer out_buf;
+    message_timer timer(r);
+    perf_counters counters;
+    bool counting = r.sending && open_counters(counters, r);
+
+    // compressed messages, retained only when simulating a receiver
+    compressed_messages compressed;
+
+    // first non-empty compressed message, used to measure inflate memory when
+    // simulating a sender
+    std::string inflate_probe;
+
+    if (!r.check_validity()) {
+        return r;
+    }
+
+    if (r.connections == 0) {
+        r.connections = (r.connection_id_column ? std::max<size_t>(1,input.connections()) : 1);
+    }
+
+    // with a memory budget contexts are only set up once they are admitted
+    size_t budget_contexts = 0;
+    if (r.context_budget > 0) {
+        zlib_context probe;
+        if (probe.init_deflate(r) != Z_OK) {
+            std::cout << "Fatal Error setting up deflate context" << std::endl;
+            r.error = true;
+            return r;
+        }
+        budget_contexts = r.context_budget / std::max<size_t>(1, probe.memory().current);
+        for (size_t i = 0; i < r.connections; i++) {
+            contexts.push_back(std::unique_ptr<zlib_context>(new zlib_context(true)));
+        }
+    } else if (!init_contexts(contexts, r, true)) {
+        return r;
+    }
+    context_lru lru(r.connections, budget_contexts);
+    r.lru_capacity = lru.capacity();
+
+    int reset_mode = r.message_reset_mode();
+    int flush = (reset_mode == reset_mode_full_flush && !r.context_takeover 
+                 ? Z_FULL_FLUSH : Z_SYNC_FLUSH);
+
+    // With context takeover a message rejected by max_ratio has already
+    // entered the sender's window but never reaches the receiver's. Each
+    // trial is made on a context copied beforehand, and the copy is kept if
+    // the message is rejected.
+    bool rollback = r.context_takeover && r.max_ratio > 0;
+    context_list snapshots;
+    if (rollback) {
+        for (size_t i = 0; i < r.connections; i++) {
+            snapshots.push_back(std::unique_ptr<zlib_context>(new zlib_context()));
+        }
+    }
+
+    if (r.idle_timeout > 0 && !input.has_timestamps()) {
+        std::cout << "idle_timeout needs input with timestamps. Use idle_messages instead." 
+                  << std::endl;
+        r.error = true;
+        return r;
+    }
+    bool hibernate = r.hibernating();
+    hibernation_tracker idle(input, r);
+
+    frame_writer frames(!r.is_server);
+    fragmenter fragments(r, frames);
+
+    for (size_t i = 0; i < input.size(); i++) {
+        line_result lr;
+        lr.payload_size = input.size(i);
+        lr.frame_overhead = fragmented_frame_overhead(!r.is_server, lr.payload_size, 
+            r.max_frame_size);
+        lr.fragments = fragment_count(lr.payload_size, r.max_frame_size);
+
+        if (lr.payload_size < r.min_size) {
+            send_uncompressed(lr);
+            if (r.sending) {
+                timer.record_untimed(lr);
+            } else {
+                compressed.append_uncompressed();
+            }
+            continue;
+        }
+
+        // compress
+        if (lr.payload_size == 0) {
+            // compressed value will be 2 bytes
+            lr.compressed_size = 2;
+            lr.ratio = 2.0;
+            if (r.sending) {
+                timer.record_untimed(lr);
+            } else {
+                compressed.append(nullptr, 0);
+            }
+            continue;
+        }
+
+        size_t c = r.context_for(input, i);
+        zlib_context & context = *contexts[c];
+        z_stream & zlib_state = context.stream();
+
+        if (hibernate) {
+            idle.arrive(i, c, context);
+        }
+
+        bool admitted = false;
+        if (r.context_budget > 0) {
+            size_t evicted;
+            int use = lru.touch(c, evicted);
+            if (use == context_lru::hit) {
+                r.lru_hits++;
+            } else {
+                if (evicted != context_lru::none) {
+                    contexts[evicted]->end();
+                }
+                if (use == context_lru::miss) {
+                    r.lru_misses++;
+                    admitted = true;
+                } else {
+                    // a connection's first context is set up untimed, as
+                    // every context is without a budget
+                    r.lru_first_uses++;
+                    if (context.init_deflate(r) != Z_OK) {
+                        std::cout << "Fatal Error setting up deflate context" << std::endl;
+                        r.error = true;
+                        return r;
+                    }
+                }
+            }
+        }
+
+        zlib_state.avail_in = lr.payload_size;
+        zlib_state.next_in = const_cast<unsigned char *>(input.data(i));
+
+        // deflateBound assumes Z_FINISH. A sync or full flush may add an empty
+        // stored block (up to 6 bytes with its alignment) on top of that.
+        size_t est_size = deflateBound(&zlib_state,lr.payload_size)+8;
+        r.output_buffer_whole = std::max(r.output_buffer_whole, est_size);
+        if (r.max_frame_size == 0) {
+            out_buf.resize(est_size);
+            out_buf.set_cursor(0);
+
+            zlib_state.avail_out = out_buf.avail();
+            zlib_state.next_out = out_buf.first_avail();
+        }
+
+        // the compression done up front when simulating a receiver is not timed
+        if (counting) {
+            counters.start();
+        }
+        if (r.sending) {
+            timer.start();
+        }
+        if (r.max_frame_size > 0) {
+            fragments.start();
+        }
+
+        // An admitted context is resident from now on whether or not this
+        // message is compressed, so it is set up again before the policy runs.
+        // The window was lost when the context was evicted.
+        if (admitted) {
+            reset_context(context, r, reset_mode_reinit, lr);
+        }
+
+        // the policy's checks are part of the cost of sending a message
+        bool compress = (r.max_entropy <= 0 || 
+            byte_entropy(input.data(i), lr.payload_size) <= r.max_entropy);
+
+        bool deflated = compress;
+        if (compress) {
+            if (admitted) {
+                // already set up again above
+            } else if (hibernate && idle.asleep(c)) {
+                // the window was lost when the context was freed
+                reset_context(context, r, reset_mode_reinit, lr);
+            } else if (reset_mode != reset_mode_full_flush) {
+                reset_context(context, r, reset_mode, lr);
+            }
+            if (rollback) {
+                snapshots[c]->copy_deflate(context);
+            }
+        }
+
+        int ret = Z_OK;
+        if (compress && r.max_frame_size > 0) {
+            ret = fragments.deflate_message(zlib_state, flush, input.opcode(i), lr, 
+                (inflate_probe.empty() ? &inflate_probe : nullptr));
+        } else if (compress) {
+            ret = deflate(&zlib_state, flush);
+            out_buf.adv_cursor(out_buf.avail() - zlib_state.avail_out);
+
+            // a flushed message always ends with the 4 byte trailer
+            if ((ret != Z_OK && ret != Z_BUF_ERROR) || 
+                out_buf.cursor() < sizeof(deflate_trailer)) 
+            {
+                std::cout << "Fatal Error compressing message " << i << std::endl;
+                r.error = true;
+                return r;
+            }
+
+            // we subtract 4 here because the final 4 byte trailer is the same on all compressed
+            // blocks and so it is implicitly omited by the permessage-deflate spec before writing
+            // on the wire and re-added by the other endpoint before inflation.
+            lr.compressed_size = out_buf.cursor()-4;
+
+            if (r.max_ratio > 0 && 
+                double(lr.compressed_size) > r.max_ratio*double(lr.payload_size)) 
+            {
+                compress = false;
+                if (rollback) {
+                    contexts[c].swap(snapshots[c]);
+                }
+            }
+        }
+
+        if (r.max_frame_size > 0) {
+            if (!compress) {
+                fragments.send_uncompressed(input.data(i), lr.payload_size, input.opcode(i), lr);
+            }
+        } else if (r.frames && r.sending) {
+            if (compress) {
+                frames.write(true, input.opcode(i), true, out_buf.data(), lr.compressed_size, lr);
+            } else {
+                frames.write(true, input.opcode(i), false, input.data(i), lr.payload_size, lr);
+            }
+        }
+
+        if (r.sending) {
+            timer.stop();
+        }
+        if (counting) {
+            counters.stop(lr.counters);
+        }
+        if (r.max_frame_size > 0) {
+            fragments.record();
+        }
+
+        if (deflated) {
+            if (hibernate) {
+                idle.used(i, c);
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                std::cout << "Fatal Error compressing message " << i << std::endl;
+                r.error = true;
+                return r;
+            }
+            if (r.max_frame_size == 0 && out_buf.avail() == 0) {
+                std::cout << "Fatal Error, needed more memory than expected." << std::endl;
+                r.error = true;
+                return r;
+            }
+        }
+
+        if (compress) {
+            if (r.max_frame_size == 0) {
+                lr.frame_overhead_compressed = frame_overhead(!r.is_server,lr.compressed_size);
+            }
+            lr.ratio = double(lr.compressed_size) / double(lr.payload_size);
+        }
+
+        if (!compress) {
+            send_uncompressed(lr);
+        }
+
+        if (!r.sending) {
+            // inflate_test records the result of receiving this message
+            if (compress) {
+                compressed.append(out_buf.data(), lr.compressed_size);
+            } else {
+                compressed.append_uncompressed();
+            }
+            continue;
+        }
+
+        timer.record(lr);
+
+        if (compress && inflate_probe.empty()) {
+            inflate_probe.assign(reinterpret_cast<char *>(out_buf.data()),
+                lr.compressed_size);
+        }
+    }
+
+    timer.flush();
+    r.output_buffer_peak = (r.max_frame_size > 0 ? fragments.buffer_size() : out_buf.capacity());
+
+    if (hibernate) {
+        idle.finish(contexts, r);
+    }
+    r.working_set = end_contexts(contexts) + end_contexts(snapshots);
+    r.deflate_memory = contexts[0]->memory();
+    if (r.context_budget > 0) {
+        // not every connection's context was necessarily set up
+        for (auto const & ctx : contexts) {
+            if (ctx->memory().peak > r.deflate_memory.peak) {
+                r.deflate_memory = ctx->memory();
+            }
+        }
+    }
+
+    if (!r.sending) {
+        // the corpus is now compressed exactly as a remote sender would have
+        // compressed it. Time inflating it instead.
+        return inflate_test(input, compressed, r);
+    }
+
+    measure_inflate_memory(inflate_probe, r);
+
+    return r;
+}
+
+// The values of each setting covered by a parameter sweep. Settings not listed
+// here are taken from the base test_result.
+struct sweep_settings {
+    std::vector<bool> context_takeover = {true, false};
+    std::vector<int> speed_level = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    std::vector<int> window_bits = {8, 9, 10, 11, 12, 13, 14, 15};
+    std::vector<int> memory_level = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+    // empty to use the base setting
+    std::vector<int> strategy;
+    std::vector<int> connections;
+
+    unsigned int threads = std::thread::hardware_concurrency();
+
+    // parse a range ("lo-hi") or list ("a,b,c") of integer values
+    static std::vector<int> parse_range(std::string const & val) {
+        std::vector<int> values;
+        std::istringstream ss(val);
+        std::string item;
+
+        while (std::getline(ss, item, ',')) {
+            auto dash = item.find('-', 1);
+            if (dash == std::string::npos) {
+                values.push_back(atoi(item.c_str()));
+            } else {
+                int lo = atoi(item.substr(0,dash).c_str());
+                int hi = atoi(item.substr(dash+1).c_str());
+                for (int v = lo; v <= hi; v++) {
+                    values.push_back(v);
+                }
+            }
+        }
+        return values;
+    }
+
+    void load_setting(std::string arg) {
+        auto pos = arg.find('=');
+        if (pos != std::string::npos) {
+            std::string key(arg.begin(),arg.begin()+pos);
+            std::string val(arg.begin()+pos+1,arg.end());
+
+            if (key == "context_takeover") {
+                context_takeover.clear();
+                if (val.find("true") != std::string::npos) {
+                    context_takeover.push_back(true);
+                }
+                if (val.find("false") != std::string::npos) {
+                    context_takeover.push_back(false);
+                }
+            } else if (key == "speed_level" || key == "speed_levels") {
+                speed_level = parse_range(val);
+            } else if (key == "window_bits") {
+                window_bits = parse_range(val);
+            } else if (key == "memory_level") {
+                memory_level = parse_range(val);
+            } else if (key == "strategy") {
+                strategy.clear();
+                std::istringstream ss(val);
+                std::string item;
+                while (std::getline(ss, item, ',')) {
+                    if (item == "all") {
+                        for (int i = 0; i < strategy_count; i++) {
+                            strategy.push_back(i);
+                        }
+                    } else {
+                        strategy.push_back(parse_strategy(item));
+                    }
+                }
+            } else if (key == "connections") {
+                connections = parse_range(val);
+            } else if (key == "threads") {
+                threads = atoi(val.c_str());
+            }
+        }
+    }
+
+    // expand the grid into one test_result per combination of settings
+    std::vector<test_result> configurations(test_result const & base) const {
+        std::vector<test_result> configs;
+        std::vector<int> conns = connections;
+        std::vector<int> strategies = strategy;
+
+        if (conns.empty()) {
+            conns.push_back(int(base.connections));
+        }
+        if (strategies.empty()) {
+            strategies.push_back(base.strategy);
+        }
+
+        for (int cn : conns) {
+            for (bool ct : context_takeover) {
+                for (int sl : speed_level) {
+                    for (int wb : window_bits) {
+                        for (int ml : memory_level) {
+                            for (int st : strategies) {
+                                test_result r = base;
+                                r.context_takeover = ct;
+                                r.speed_level = sl;
+                                r.window_bits = wb;
+                                r.memory_level = ml;
+                                r.strategy = st;
+                                r.connections = cn;
+                                r.keep_messages = false;
+                                configs.push_back(r);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return configs;
+    }
+};
+
+// two sided 95% critical value of Student's t distribution
+double t_critical_95(size_t degrees_of_freedom) {
+    static double const table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (degrees_of_freedom == 0) {
+        return 0;
+    }
+    if (degrees_of_freedom <= sizeof(table)/sizeof(table[0])) {
+        return table[degrees_of_freedom-1];
+    }
+    return 1.960;
+}
+
+// Run a test r.warmup times without measuring it, then r.repeat times, each
+// with fresh contexts. Returns the run with the median throughput, annotated
+// with the throughput of every run.
+test_result repeat_test(corpus const & input, test_result const & r) {
+    for (int i = 0; i < r.warmup; i++) {
+        test_result warm = r;
+        warm.keep_messages = false;
+        if (deflate_test(input, warm).error) {
+            break;
+        }
+    }
+
+    std::vector<test_result> runs;
+    std::vector<double> throughput;
+    for (int i = 0; i < r.repeat; i++) {
+        runs.push_back(deflate_test(input, r));
+        if (runs.back().error) {
+            return runs.back();
+        }
+        throughput.push_back((double(runs.back().total_payload)/1000000.0) 
+            / runs.back().total_elapsed_seconds);
+    }
+
+    std::vector<size_t> order(runs.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return throughput[a] < throughput[b];
+    });
+    test_result result = runs[order[order.size()/2]];
+
+    double sum = 0;
+    for (double t : throughput) {
+        sum += t;
+    }
+    double mean = sum/double(throughput.size());
+
+    double variance = 0;
+    for (double t : throughput) {
+        variance += (t-mean)*(t-mean);
+    }
+    size_t n = throughput.size();
+    variance = (n > 1 ? variance/double(n-1) : 0);
+
+    result.repetition_throughput = throughput;
+    result.throughput_mean = mean;
+    result.throughput_stddev = std::sqrt(variance);
+    result.throughput_ci95 = t_critical_95(n-1)*result.throughput_stddev/std::sqrt(double(n));
+    return result;
+}
+
+// Run every configuration against the same corpus on a pool of worker threads
+std::vector<test_result> run_sweep(corpus const & input, 
+    std::vector<test_result> configs, unsigned int threads)
+{
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < configs.size(); i = next++) {
+            configs[i] = repeat_test(input, configs[i]);
+            configs[i].calc_stats();
+        }
+    };
+
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads && i < configs.size(); i++) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+
+    for (auto & t : pool) {
+        t.join();
+    }
+
+    return configs;
+}
+
+// Constraints used by optimize to choose a single configuration. A value of
+// zero leaves that dimension unconstrained.
+struct optimize_settings {
+    size_t max_memory = 0;
+    double max_p99 = 0;
+    double max_cpu_per_mb = 0;
+
+    void load_setting(std::string arg) {
+        auto pos = arg.find('=');
+        if (pos != std::string::npos) {
+            std::string key(arg.begin(),arg.begin()+pos);
+            std::string val(arg.begin()+pos+1,arg.end());
+
+            if (key == "max_memory") {
+                max_memory = parse_bytes(val);
+            } else if (key == "max_p99") {
+                max_p99 = parse_seconds(val);
+            } else if (key == "max_cpu_per_mb") {
+                max_cpu_per_mb = parse_seconds(val);
+            }
+        }
+    }
+
+    bool satisfied_by(test_result const & r) const {
+        return !r.error
+            && (max_memory == 0 || r.context_memory() <= max_memory)
+            && (max_p99 == 0 || r.p99_elapsed_seconds <= max_p99)
+            && (max_cpu_per_mb == 0 || r.cpu_seconds_per_mb() <= max_cpu_per_mb);
+    }
+};
+
+// true if a is at least as good as b on compressed size, CPU per MB and context
+// memory and strictly better on at least one of them
+bool dominates(test_result const & a, test_result const & b) {
+    bool no_worse = a.total_compressed_size <= b.total_compressed_size
+                 && a.cpu_seconds_per_mb() <= b.cpu_seconds_per_mb()
+                 && a.context_memory() <= b.context_memory();
+    bool better = a.total_compressed_size < b.total_compressed_size
+               || a.cpu_seconds_per_mb() < b.cpu_seconds_per_mb()
+               || a.context_memory() < b.context_memory();
+    return no_worse && better;
+}
+
+// order by compressed size, breaking ties by CPU and then memory
+bool better_compression(test_result const & a, test_result const & b) {
+    if (a.total_compressed_size != b.total_compressed_size) {
+        return a.total_compressed_size < b.total_compressed_size;
+    }
+    if (a.cpu_seconds_per_mb() != b.cpu_seconds_per_mb()) {
+        return a.cpu_seconds_per_mb() < b.cpu_seconds_per_mb();
+    }
+    return a.context_memory() < b.context_memory();
+}
+
+// the configurations not dominated by any other, ordered by compressed size
+std::vector<test_result> pareto_front(std::vector<test_result> const & results) {
+    std::vector<test_result> front;
+
+    for (auto const & candidate : results) {
+        if (candidate.error) {
+            continue;
+        }
+
+        bool dominated = false;
+        for (auto const & other : results) {
+            if (!other.error && dominates(other, candidate)) {
+                dominated = true;
+                break;
+            }
+        }
+
+        if (!dominated) {
+            front.push_back(candidate);
+        }
+    }
+
+    std::sort(front.begin(), front.end(), better_compression);
+    return front;
+}
+
+// the configuration that satisfies the constraints with the smallest output,
+// or nullptr if none do
+test_result const * choose_configuration(std::vector<test_result> const & results,
+    optimize_settings const & constraints)
+{
+    test_result const * best = nullptr;
+
+    for (auto const & r : results) {
+        if (constraints.satisfied_by(r) && (!best || better_compression(r, *best))) {
+            best = &r;
+        }
+    }
+    return best;
+}
+
+// length of the substrings counted by train_dictionary
+size_t const dictionary_dmer_size = 8;
+
+// Build a preset dictionary of at most size bytes from a sample of messages
+// with a simplified form of the COVER algorithm used by zstd's dictionary
+// builder. Each 8 byte substring is scored by the number of messages that
+// contain it. The sample is split into one epoch per segment the dictionary
+// has room for, and from each epoch the segment_size bytes of a message whose
+// distinct substrings score highest are taken. The substrings of a chosen
+// segment score nothing afterwards so that later segments cover new content.
+// The highest scoring segments go last, where matches against them are
+// shortest and where they survive being cut down to a smaller window.
+std::string train_dictionary(corpus const & sample, size_t size, size_t segment_size) {
+    struct segment {
+        size_t message = 0;
+        size_t offset = 0;
+        size_t length = 0;
+        uint64_t score = 0;
+    };
+
+    auto dmer = [](unsigned char const * p) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    };
+
+    std::unordered_map<uint64_t, uint64_t> frequency;
+    std::vector<uint64_t> distinct;
+    size_t sample_bytes = 0;
+
+    for (size_t i = 0; i < sample.size(); i++) {
+        sample_bytes += sample.size(i);
+        if (sample.size(i) < dictionary_dmer_size) {
+            continue;
+        }
+        distinct.clear();
+        for (size_t j = 0; j+dictionary_dmer_size <= sample.size(i); j++) {
+            distinct.push_back(dmer(sample.data(i)+j));
+        }
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+        for (uint64_t v : distinct) {
+            frequency[v]++;
+        }
+    }
+
+    size_t epochs = std::max<size_t>(1, size / segment_size);
+    size_t epoch_bytes = std::max<size_t>(1, sample_bytes / epochs);
+
+    std::vector<segment> chosen;
+    std::unordered_map<uint64_t, size_t> active;
+    size_t i = 0;
+
+    while (i < sample.size()) {
+        // best segment of the messages in this epoch
+        segment best;
+        size_t epoch_end = 0;
+
+        for (; i < sample.size() && epoch_end < epoch_bytes; i++) {
+            size_t n = sample.size(i);
+            epoch_end += n;
+            if (n < dictionary_dmer_size) {
+                continue;
+            }
+
+            size_t length = std::min(segment_size, n);
+            size_t window = length-dictionary_dmer_size+1;
+            uint64_t score = 0;
+            active.clear();
+
+            for (size_t j = 0; j+dictionary_dmer_size <= n; j++) {
+                uint64_t v = dmer(sample.data(i)+j);
+                if (active[v]++ == 0) {
+                    score += frequency[v];
+                }
+                if (j >= window) {
+                    uint64_t old = dmer(sample.data(i)+j-window);
+                    if (--active[old] == 0) {
+                        score -= frequency[old];
+                    }
+                }
+                if (j+1 >= window && score > best.score) {
+                    best.message = i;
+                    best.offset = j+1-window;
+                    best.length = length;
+                    best.score = score;
+                }
+            }
+        }
+
+        if (best.score == 0) {
+            continue;
+        }
+
+        unsigned char const * p = sample.data(best.message)+best.offset;
+        for (size_t j = 0; j+dictionary_dmer_size <= best.length; j++) {
+            frequency[dmer(p+j)] = 0;
+        }
+        chosen.push_back(best);
+    }
+
+    std::stable_sort(chosen.begin(), chosen.end(), [](segment const & a, segment const & b) {
+        return a.score < b.score;
+    });
+
+    std::string dictionary;
+    for (auto const & s : chosen) {
+        dictionary.append(reinterpret_cast<char const *>(sample.data(s.message))+s.offset,
+            s.length);
+    }
+    if (dictionary.size() > size) {
+        dictionary.erase(0, dictionary.size()-size);
+    }
+    return dictionary;
+}
+
+// Train dictionaries with several segment sizes on a sample of the input and
+// keep the one that best compresses the messages held out of the sample under
+// the settings in r. Prints a report if report is set.
+std::string train_dictionary(corpus const & input, test_result const & r, size_t size, 
+    bool report)
+{
+    // train on at most this many bytes, taken evenly from across the input
+    size_t const max_sample = 8*1024*1024;
+    size_t const segment_sizes[] = {64, 128, 256, 512};
+
+    size_t total = 0;
+    for (size_t i = 0; i < input.size(); i++) {
+        total += input.size(i);
+    }
+    size_t stride = std::max<size_t>(1, (total+max_sample-1) / max_sample);
+
+    // every tenth sampled message is held out to judge the dictionaries by
+    corpus sample;
+    corpus held_out;
+    size_t sampled = 0;
+    for (size_t i = 0; i < input.size(); i += stride, sampled++) {
+        corpus & c = (sampled % 10 == 9 ? held_out : sample);
+        c.append(input.data(i), input.size(i), input.connection(i), input.opcode(i), 
+            input.timestamp(i));
+    }
+    corpus const & judge = (held_out.size() > 0 ? held_out : sample);
+
+    // only the end of a dictionary longer than the window is used
+    size = std::min<size_t>(size, size_t(1) << zlib_window_bits(r.window_bits));
+
+    test_result base = r;
+    base.sending = true;
+    base.keep_messages = false;
+    base.dictionary.reset();
+    base.dictionary_file.clear();
+
+    test_result plain = deflate_test(judge, base);
+    if (plain.error) {
+        return std::string();
+    }
+
+    if (report) {
+        std::cout << "Training on " << sample.size() << " messages, judging on " 
+                  << judge.size() << (held_out.size() > 0 ? " held out" : "") 
+                  << " messages" << std::endl << std::endl;
+        std::cout << std::left << std::setw(10) << "segment" << std::setw(16) 
+                  << "dictionary(B)" << std::setw(16) << "compressed(B)" << "ratio" 
+                  << std::endl;
+        std::cout << std::left << std::setw(10) << "none" << std::setw(16) << 0 
+                  << std::setw(16) << plain.total_compressed_size 
+                  << double(plain.total_compressed_size)/double(plain.total_payload) 
+                  << std::endl;
+    }
+
+    std::string best;
+    size_t best_segment = 0;
+    size_t best_compressed = plain.total_compressed_size;
+
+    for (size_t segment_size : segment_sizes) {
+        std::string dictionary = train_dictionary(sample, size, segment_size);
+        test_result t = base;
+        t.dictionary = std::make_shared<std::string const>(dictionary);
+        t = deflate_test(judge, t);
+        if (t.error) {
+            return std::string();
+        }
+
+        if (report) {
+            std::cout << std::left << std::setw(10) << segment_size << std::setw(16) 
+                      << dictionary.size() << std::setw(16) << t.total_compressed_size 
+                      << double(t.total_compressed_size)/double(t.total_payload) 
+                      << std::endl;
+        }
+
+        if (t.total_compressed_size < best_compressed) {
+            best = dictionary;
+            best_segment = segment_size;
+            best_compressed = t.total_compressed_size;
+        }
+    }
+
+    if (report) {
+        std::cout << std::endl;
+        if (best.empty()) {
+            std::cout << "No dictionary improved on compressing without one." << std::endl;
+        } else {
+            std::cout << "Chose segment size " << best_segment << ": " << best.size() 
+                      << " byte dictionary, " 
+                      << (1.0-double(best_compressed)/double(plain.total_compressed_size))*100.0 
+                      << "% smaller than without" << std::endl;
+        }
+    }
+    return best;
+}
+
+// at least this many runs of each policy are made, and the median kept
+const int policy_min_repeat = 5;
+
+// Compare compression policies against compressing every message. Runs the
+// base settings once with no policy and once per candidate threshold, prints
+// the CPU each saves and the bytes each adds, and chooses a min_size. Without
+// a wire_cost that is the one that puts the fewest bytes on the wire,
+// preferring the one that skips more messages when two tie as it saves more
+// CPU. With one it is the one with the least CPU time once every byte sent is
+// charged wire_cost. Returns false if a test failed.
+bool run_policies(corpus const & input, test_result const & r, double wire_cost) {
+    size_t const sizes[] = {8, 16, 32, 64, 128, 256, 512, 1024};
+    double const entropies[] = {6.0, 7.0, 7.5};
+    double const ratios[] = {1.0, 0.95, 0.9, 0.8};
+
+    test_result base = r;
+    base.min_size = 0;
+    base.max_entropy = 0;
+    base.max_ratio = 0;
+    base.keep_messages = false;
+
+    // The policies only differ by the work they skip, which is small next to
+    // the noise of runs competing for the CPU, so they are run one at a time
+    // and each is the median of several runs.
+    base.repeat = std::max(base.repeat, policy_min_repeat);
+    base.warmup = std::max(base.warmup, 1);
+
+    std::vector<test_result> configs(1, base);
+    for (size_t t : sizes) {
+        configs.push_back(base);
+        configs.back().min_size = t;
+    }
+    for (double e : entropies) {
+        configs.push_back(base);
+        configs.back().max_entropy = e;
+    }
+    for (double q : ratios) {
+        configs.push_back(base);
+        configs.back().max_ratio = q;
+    }
+
+    std::vector<test_result> results = run_sweep(input, configs, 1);
+    for (auto const & result : results) {
+        if (result.error) {
+            return false;
+        }
+    }
+
+    test_result const & all = results[0];
+    auto wire = [](test_result const & t) {
+        return t.total_compressed_size + t.total_frame_overhead_compressed;
+    };
+    auto cost = [&](test_result const & t) {
+        return t.total_elapsed_seconds + double(wire(t))*wire_cost;
+    };
+
+    std::cout << std::left << std::setw(18) << "policy" 
+              << std::setw(14) << "uncompressed"
+              << std::setw(12) << "wire(KB)"
+              << std::setw(14) << "elapsed(ms)"
+              << std::setw(14) << "cpu saved(%)"
+              << std::setw(14) << "bytes lost"
+              << std::endl;
+
+    for (auto const & t : results) {
+        std::ostringstream policy;
+        if (t.min_size > 0) {
+            policy << "min_size=" << t.min_size;
+        } else if (t.max_entropy > 0) {
+            policy << "max_entropy=" << t.max_entropy;
+        } else if (t.max_ratio > 0) {
+            policy << "max_ratio=" << t.max_ratio;
+        } else {
+            policy << "compress all";
+        }
+
+        std::cout << std::left << std::setw(18) << policy.str()
+                  << std::setw(14) << t.uncompressed_messages
+                  << std::setw(12) << double(wire(t))/1000.0
+                  << std::setw(14) << t.total_elapsed_seconds*1000.0
+                  << std::setw(14) << (1.0 - t.total_elapsed_seconds/all.total_elapsed_seconds)*100.0
+                  << std::setw(14) << (long long)(wire(t)) - (long long)(wire(all))
+                  << std::endl;
+    }
+
+    test_result const * best = &all;
+    for (size_t i = 1; i <= sizeof(sizes)/sizeof(sizes[0]); i++) {
+        bool better;
+        if (wire_cost > 0) {
+            better = cost(results[i]) < cost(*best);
+        } else {
+            better = wire(results[i]) < wire(*best) || (wire(results[i]) == wire(*best) 
+                && results[i].uncompressed_messages > best->uncompressed_messages);
+        }
+        if (better) {
+            best = &results[i];
+        }
+    }
+
+    std::cout << std::endl;
+    if (wire_cost > 0) {
+        std::cout << "Choosing by CPU time, with " << wire_cost*1000000000.0 
+                  << "ns charged per byte sent" << std::endl;
+    } else {
+        std::cout << "Choosing by bytes on the wire only. Set wire_cost to weigh CPU time "
+                  << "against them." << std::endl;
+    }
+    if (best->uncompressed_messages == 0) {
+        std::cout << "Chosen: compress every message, no min_size " 
+                  << (wire_cost > 0 ? "costs less." : "saves bytes.") << std::endl;
+    } else {
+        std::cout << "Chosen: min_size=" << best->min_size << ", " 
+                  << (1.0 - best->total_elapsed_seconds/all.total_elapsed_seconds)*100.0 
+                  << "% less CPU and ";
+        // with a wire_cost the CPU saved may be worth sending more bytes
+        if (wire(*best) > wire(all)) {
+            std::cout << wire(*best)-wire(all) << " more";
+        } else {
+            std::cout << wire(all)-wire(*best) << " fewer";
+        }
+        std::cout << " bytes on the wire than compressing every message" << std::endl;
+    }
+    return true;
+}
+
+// Compare hibernation thresholds against never freeing contexts. Uses input
+// timestamps if there are any and message counts otherwise. Returns false if
+// a test failed.
+bool run_hibernation(corpus const & input, test_result const & r, unsigned int threads) {
+    double const timeouts[] = {0.1, 1, 10, 30, 60, 300, 1800};
+    size_t const counts[] = {1, 4, 16, 64, 256, 1024, 4096, 16384, 65536};
+    bool by_time = input.has_timestamps();
+
+    test_result base = r;
+    base.idle_timeout = 0;
+    base.idle_messages = 0;
+    base.keep_messages = false;
+
+    std::vector<test_result> configs(1, base);
+    if (by_time) {
+        for (double t : timeouts) {
+            configs.push_back(base);
+            configs.back().idle_timeout = t;
+        }
+    } else {
+        for (size_t n : counts) {
+            if (n >= input.size()) {
+                break;
+            }
+            configs.push_back(base);
+            configs.back().idle_messages = n;
+        }
+    }
+
+    std::vector<test_result> results = run_sweep(input, configs, threads);
+    for (auto const & result : results) {
+        if (result.error) {
+            return false;
+        }
+    }
+
+    // memory held without hibernation, which every hibernating run reports
+    double always = (results.size() > 1 ? results[1].context_memory_time_always : 0);
+
+    std::cout << std::left << std::setw(14) << (by_time ? "idle_timeout" : "idle_messages")
+              << std::setw(14) << "hibernated"
+              << std::setw(12) << "ratio"
+              << std::setw(16) << "compressed(KB)"
+              << std::setw(14) << "extra bytes"
+              << std::setw(18) << (by_time ? "held(KiB-s)" : "held(KiB-msgs)")
+              << std::setw(12) << "saved(%)"
+              << std::endl;
+
+    for (auto const & t : results) {
+        std::ostringstream threshold;
+        if (!t.hibernating()) {
+            threshold << "never";
+        } else if (by_time) {
+            threshold << t.idle_timeout << "s";
+        } else {
+            threshold << t.idle_messages;
+        }
+        double held = (t.hibernating() ? t.context_memory_time : always);
+
+        std::cout << std::left << std::setw(14) << threshold.str()
+                  << std::setw(14) << t.hibernations
+                  << std::setw(12) << t.total_ratio
+                  << std::setw(16) << double(t.total_compressed_size)/1000.0
+                  << std::setw(14) << (long long)(t.total_compressed_size) 
+                                      - (long long)(results[0].total_compressed_size)
+                  << std::setw(18) << held/1024.0
+                  << std::setw(12) << (always > 0 ? (1.0 - held/always)*100.0 : 0.0)
+                  << std::endl;
+    }
+    return true;
+}
+
+// Compare memory budgets for resident contexts against keeping a context for
+// every connection. Budgets hold from one context up to one per connection,
+// doubling each time. Returns false if a test failed.
+bool run_lru(corpus const & input, test_result const & r, unsigned int threads) {
+    test_result base = r;
+    base.context_budget = 0;
+    base.keep_messages = false;
+    if (base.connections == 0) {
+        base.connections = (base.connection_id_column 
+                            ? std::max<size_t>(1,input.connections()) : 1);
+    }
+
+    zlib_context probe;
+    if (!base.check_validity() || probe.init_deflate(base) != Z_OK) {
+        return false;
+    }
+    size_t context_size = probe.memory().current;
+
+    std::vector<test_result> configs(1, base);
+    for (size_t n = 1; n < base.connections; n *= 2) {
+        configs.push_back(base);
+        configs.back().context_budget = n*context_size;
+    }
+
+    std::vector<test_result> results = run_sweep(input, configs, threads);
+    for (auto const & result : results) {
+        if (result.error) {
+            return false;
+        }
+    }
+
+    test_result const & all = results[0];
+    std::cout << "Connections: " << base.connections << ", " 
+              << double(context_size)/1024.0 << "KiB per context" << std::endl << std::endl;
+
+    std::cout << std::left << std::setw(14) << "budget(KiB)"
+              << std::setw(10) << "contexts"
+              << std::setw(12) << "hit rate"
+              << std::setw(12) << "ratio"
+              << std::setw(16) << "degradation(%)"
+              << std::setw(12) << "setup(ms)"
+              << std::setw(14) << "elapsed(ms)"
+              << std::endl;
+
+    for (auto const & t : results) {
+        size_t contexts = (t.context_budget > 0 ? t.lru_capacity : t.connections);
+        size_t lookups = t.lru_hits + t.lru_misses;
+
+        std::cout << std::left << std::setw(14) << double(contexts*context_size)/1024.0
+                  << std::setw(10) << contexts
+                  << std::setw(12) << (t.context_budget == 0 || lookups == 0 ? 100.0 
+                                       : double(t.lru_hits)/double(lookups)*100.0)
+                  << std::setw(12) << t.total_ratio
+                  << std::setw(16) << (t.total_ratio/all.total_ratio - 1.0)*100.0
+                  << std::setw(12) << t.total_setup_seconds*1000.0
+                  << std::setw(14) << t.total_elapsed_seconds*1000.0
+                  << std::endl;
+    }
+    return true;
+}
+
+// Largest number of subscribers run_fanout keeps live contexts for. Costs for
+// more subscribers are extrapolated from the largest run.
+const size_t fanout_measured_limit = 256;
+
+// Send every message of the input to n subscribers, each with its own context.
+// Each message is compressed for every subscriber in turn, as a broadcasting
+// server would, so all n contexts compete for the CPU cache. Totals cover
+// all n copies of the input.
+test_result broadcast_test(corpus const & input, test_result r, size_t n) {
+    corpus copies(input, n);
+
+    r.context_takeover = true;
+    r.connections = n;
+    r.connection_id_column = true;
+    return repeat_test(copies, r);
+}
+
+// Compare two ways of broadcasting every message of the input to subscribers.
+// A server without context takeover compresses each message once and sends
+// the same bytes to all of them. A server with context takeover keeps a
+// context per subscriber and compresses each message once per subscriber.
+// Up to fanout_measured_limit subscribers are run with a live context each,
+// so that the cost of their combined working set is measured. Their outputs
+// are identical, so bytes on the wire scale exactly. wire_cost is the CPU
+// time spent per byte sent, such as for TLS, used to find the fan-out at
+// which shared compression becomes cheaper overall. Returns false if a test
+// failed.
+bool run_fanout(corpus const & input, test_result const & r, size_t fanout, 
+    double wire_cost)
+{
+    test_result config = r;
+    config.context_takeover = false;
+    config.connections = 1;
+    config.connection_id_column = false;
+    config.keep_messages = false;
+
+    test_result shared = repeat_test(input, config);
+    if (shared.error) {
+        return false;
+    }
+    shared.calc_stats();
+
+    std::vector<size_t> rows;
+    for (size_t n = 1; n < fanout; n *= 4) {
+        rows.push_back(n);
+    }
+    rows.push_back(fanout);
+
+    double messages = double(std::max<size_t>(1, shared.messages));
+    // CPU seconds per subscriber per message for each row that is measured
+    std::vector<double> own_cpu;
+    test_result own;
+    for (size_t n : rows) {
+        if (n > fanout_measured_limit) {
+            break;
+        }
+        test_result t = broadcast_test(input, config, n);
+        if (t.error) {
+            return false;
+        }
+        t.calc_stats();
+        own_cpu.push_back(t.total_elapsed_seconds/(messages*double(n)));
+        if (n == 1) {
+            own = t;
+        }
+    }
+    double measured_cpu = own_cpu.back();
+
+    // CPU seconds and bytes on the wire per subscriber per message
+    double shared_cpu = shared.total_elapsed_seconds/messages;
+    double shared_bytes = double(shared.total_compressed_size 
+        + shared.total_frame_overhead_compressed)/messages;
+    double own_bytes = double(own.total_compressed_size 
+        + own.total_frame_overhead_compressed)/messages;
+
+    std::cout << "Per message: shared compression " << shared_cpu*1000000.0 << "us, "
+              << shared_bytes << "B; per subscriber context " << own_cpu[0]*1000000.0 
+              << "us, " << own_bytes << "B with one subscriber" << std::endl << std::endl;
+
+    std::cout << std::left << std::setw(14) << "subscribers"
+              << std::setw(14) << "shared(us)"
+              << std::setw(14) << "own(us)"
+              << std::setw(14) << "shared(KB)"
+              << std::setw(14) << "own(KB)"
+              << std::setw(16) << "shared(KiB)"
+              << std::setw(16) << "own(KiB)"
+              << "own CPU"
+              << std::endl;
+
+    for (size_t i = 0; i < rows.size(); i++) {
+        double subscribers = double(rows[i]);
+        bool measured = (i < own_cpu.size());
+        double cpu = (measured ? own_cpu[i] : measured_cpu);
+        std::cout << std::left << std::setw(14) << rows[i]
+                  << std::setw(14) << shared_cpu*1000000.0
+                  << std::setw(14) << cpu*subscribers*1000000.0
+                  << std::setw(14) << shared_bytes*subscribers/1000.0
+                  << std::setw(14) << own_bytes*subscribers/1000.0
+                  << std::setw(16) << double(shared.context_memory())/1024.0
+                  << std::setw(16) << double(own.context_memory())*subscribers/1024.0
+                  << (measured ? "measured" : "extrapolated")
+                  << std::endl;
+    }
+    if (own_cpu.size() < rows.size()) {
+        std::cout << "Per subscriber CPU above " << rows[own_cpu.size()-1] 
+                  << " subscribers is extrapolated linearly from the largest measured "
+                  << "run and leaves out further cache effects." << std::endl;
+    }
+    std::cout << std::endl;
+    double costs[] = {0, wire_cost};
+    for (int i = 0; i < (wire_cost > 0 ? 2 : 1); i++) {
+        double per_subscriber = measured_cpu + (own_bytes - shared_bytes)*costs[i];
+        std::cout << (i == 0 ? "CPU alone: " : "CPU including wire cost: ");
+        if (per_subscriber <= 0) {
+            std::cout << "per subscriber contexts are cheaper at any fan-out" << std::endl;
+        } else {
+            std::cout << "shared compression is cheaper from " 
+                      << size_t(std::floor(shared_cpu/per_subscriber)) + 1 
+                      << " subscribers" << std::endl;
+        }
+    }
+    std::cout << "Per subscriber contexts send " 
+              << (1.0 - own_bytes/shared_bytes)*100.0 << "% fewer bytes and hold "
+              << double(own.context_memory())*double(fanout)/1024.0/1024.0 
+              << "MiB of contexts for " << fanout << " subscribers" << std::endl;
+    return true;
+}
+
+// Compare the byte at a time masking loop with mask_payload_fast over the
+// messages of the input, each written after its header as in a client's
+// frame. The messages of each size class are masked together in one timed
+// pass, repeated repeat times after warmup untimed passes, and the median
+// pass is reported. Returns false if the two kernels disagree.
+bool run_mask_benchmark(corpus const & input, test_result const & r) {
+    typedef void (*mask_function)(unsigned char *, unsigned char const *, size_t, 
+        unsigned char const *);
+    mask_function const kernels[2] = {mask_payload, mask_payload_fast};
+
+    // the key of the masked frame example in RFC 6455 section 5.7
+    unsigned char const key[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+    std::vector<size_t> members[size_class_count];
+    std::vector<size_t> offsets(input.size());
+    size_t largest = 0;
+    for (size_t i = 0; i < input.size(); i++) {
+        members[size_class(input.size(i))].push_back(i);
+        offsets[i] = frame_overhead(true, input.size(i));
+        largest = std::max(largest, input.size(i));
+    }
 
-size_t frame_overhead(bool masked, size_t payload_size) {
-    size_t size = (masked ? 4 : 0);
+    pod_buffer out[2];
+    for (pod_buffer & b : out) {
+        b.resize(largest + max_frame_header);
+    }
 
-    if (payload_size <= 125) {
-        size += 2;
-    } else if (payload_size <= 0xffff) {
-        size += 4;
-    } else {
-        size += 8;
+    for (size_t i = 0; i < input.size(); i++) {
+        for (int k = 0; k < 2; k++) {
+            kernels[k](out[k].data()+offsets[i], input.data(i), input.size(i), key);
+        }
+        if (std::memcmp(out[0].data()+offsets[i], out[1].data()+offsets[i], 
+            input.size(i)) != 0) 
+        {
+            std::cout << "Fatal Error, masking kernels disagree on message " << i << std::endl;
+            return false;
+        }
     }
-    return size;
-}
 
-struct line_result {
-    size_t payload_size;
-    size_t frame_overhead;
-    size_t frame_overhead_compressed;
-    size_t compressed_size;
-    double ratio;
-    double elapsed_seconds;
-    // test length in sec
-};
+    std::cout << "Masking kernel: " << mask_kernel_name << ", median of " << r.repeat 
+              << " pass(es)" << std::endl << std::endl;
+    std::cout << std::left << std::setw(20) << "size class"
+              << std::setw(10) << "messages"
+              << std::setw(12) << "mean(B)"
+              << std::setw(14) << "loop(ns/msg)"
+              << std::setw(16) << "kernel(ns/msg)"
+              << std::setw(14) << "loop(GB/s)"
+              << std::setw(14) << "kernel(GB/s)"
+              << std::setw(10) << "speedup"
+              << std::endl;
 
-struct test_result {
-    bool error = false;
+    size_t all_messages = 0;
+    size_t all_bytes = 0;
+    double all_seconds[2] = {0, 0};
 
-    // test settings
-    bool is_server = true;
-    bool sending = true;
-    bool context_takeover = true;
-    int speed_level = 6;
-    int window_bits = 15;
-    int memory_level = 8;
+    for (size_t c = 0; c <= size_class_count; c++) {
+        size_t messages = all_messages;
+        size_t bytes = all_bytes;
+        double seconds[2] = {all_seconds[0], all_seconds[1]};
 
-    // test results
-    std::vector<line_result> line_results;
+        if (c < size_class_count) {
+            if (members[c].empty()) {
+                continue;
+            }
+            messages = members[c].size();
+            bytes = 0;
+            for (size_t i : members[c]) {
+                bytes += input.size(i);
+            }
 
-    // aggregate stats
-    size_t total_payload;
-    size_t total_frame_overhead;
-    size_t total_frame_overhead_compressed;
-    size_t total_compressed_size;
-    double total_ratio;
-    double total_elapsed_seconds;
+            for (int k = 0; k < 2; k++) {
+                std::vector<double> passes;
+                for (int pass = 0; pass < r.warmup + r.repeat; pass++) {
+                    message_clock::ticks start = message_clock::start();
+                    for (size_t i : members[c]) {
+                        kernels[k](out[k].data()+offsets[i], input.data(i), input.size(i), key);
+                    }
+                    message_clock::ticks t = message_clock::stop() - start;
+                    if (pass >= r.warmup) {
+                        passes.push_back(message_clock::to_seconds(
+                            t > message_clock::overhead() ? t - message_clock::overhead() : 0));
+                    }
+                }
+                std::sort(passes.begin(), passes.end());
+                seconds[k] = passes[passes.size()/2];
+                all_seconds[k] += seconds[k];
+            }
+            all_messages += messages;
+            all_bytes += bytes;
+        }
 
-    // memory stats
-    size_t mem_usage;
-    size_t mem_usage_inflate_32;
-    size_t mem_usage_inflate_64;
+        std::cout << std::left << std::setw(20) 
+                  << (c < size_class_count ? size_class_names[c] : "all")
+                  << std::setw(10) << messages
+                  << std::setw(12) << double(bytes)/double(std::max<size_t>(1, messages))
+                  << std::setw(14) << seconds[0]*1000000000.0/double(std::max<size_t>(1, messages))
+                  << std::setw(16) << seconds[1]*1000000000.0/double(std::max<size_t>(1, messages))
+                  << std::setw(14) << (seconds[0] > 0 ? double(bytes)/seconds[0]/1000000000.0 : 0.0)
+                  << std::setw(14) << (seconds[1] > 0 ? double(bytes)/seconds[1]/1000000000.0 : 0.0)
+                  << std::setw(10) << (seconds[1] > 0 ? seconds[0]/seconds[1] : 0.0)
+                  << std::endl;
+    }
+    return true;
+}
+
+// The shape of a context pool simulation
+struct pool_settings {
+    // contexts in the pool, 0 for one per worker
+    size_t contexts = 0;
+    unsigned int workers = std::thread::hardware_concurrency();
 
     void load_setting(std::string arg) {
         auto pos = arg.find('=');
         if (pos != std::string::npos) {
             std::string key(arg.begin(),arg.begin()+pos);
             std::string val(arg.begin()+pos+1,arg.end());
-            
-            if (key == "server") {
-                is_server = (val == "true" ? true : false);
-            } else if (key == "sending") {
-                sending = (val == "true" ? true : false);
-            } else if (key == "context_takeover") {
-                context_takeover = (val == "true" ? true : false);
-            } else if (key == "speed_levels") {
-                speed_level = atoi(val.c_str()); 
-            } else if (key == "window_bits") {
-                window_bits = atoi(val.c_str()); 
-            } else if (key == "memory_level") {
-                memory_level = atoi(val.c_str()); 
+
+            if (key == "pool_size") {
+                contexts = atoi(val.c_str());
+            } else if (key == "workers") {
+                workers = atoi(val.c_str());
             }
         }
     }
+};
 
-    bool check_validity() {
-        if (speed_level > 9 || speed_level < 0) {
-            std::cout << "Speed level must be between 0 (fastest, no compression) and 9 (slowest, best compression). Default is 6" << std::endl;
-            error = true;
-        }
-        if (window_bits > 15 || window_bits < 8) {
-            std::cout << "Window bits must be between 8 (lower memory usage, worse compression) and 15 (highest memory usage, best compression). Default is 15." << std::endl;
-            error = true;
+// A fixed set of deflate contexts shared by worker threads. acquire() blocks
+// while every context is in use. Released contexts are reused most recent
+// first, as their memory is the most likely to still be cached.
+class context_pool {
+public:
+    context_pool() : m_in_use(0), m_peak_in_use(0), m_lock_contended(0) {}
+
+    bool init(size_t size, test_result r) {
+        r.connections = size;
+        if (!init_contexts(m_contexts, r, true)) {
+            return false;
         }
-        if (memory_level > 9 || memory_level < 1) {
-            std::cout << "Memory level must be between 1 (lower memory usage, worse compression) and 9 (highest memory usage, best compression). Default is 8." << std::endl;
-            error = true;
+        for (auto & c : m_contexts) {
+            m_free.push_back(c.get());
         }
-        return !error;
+        return true;
     }
 
-    // build aggregate stats from line_results
-    void calc_stats() {
-        total_payload = 0;
-        total_frame_overhead = 0;
-        total_frame_overhead_compressed = 0;
-        total_compressed_size = 0;
-        total_ratio = 0;
-
-        for (auto & lr : line_results) {
-            total_payload += lr.payload_size;
-            total_frame_overhead += lr.frame_overhead;
-            total_frame_overhead_compressed += lr.frame_overhead_compressed;
-            total_compressed_size += lr.compressed_size;
-            total_elapsed_seconds += lr.elapsed_seconds;
+    // take a context, setting waited if none was free
+    zlib_context * acquire(bool & waited) {
+        std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            lock.lock();
+            m_lock_contended++;
         }
 
-        total_ratio = double(total_compressed_size) / double(total_payload);
+        waited = m_free.empty();
+        m_available.wait(lock, [this]() { return !m_free.empty(); });
 
-        if (sending) {
-            mem_usage = (1 << (window_bits + 2)) + (1 << (memory_level + 9));
-            mem_usage_inflate_32 = (1 << window_bits) + 1440*2*4;
-            mem_usage_inflate_64 = (1 << window_bits) + 1440*2*8;
-        } else {
-            mem_usage = (1 << window_bits) + 1440*2*sizeof(int);
-            mem_usage_inflate_32 = 0;
-            mem_usage_inflate_64 = 0;
-        }
+        zlib_context * c = m_free.back();
+        m_free.pop_back();
+        m_peak_in_use = std::max(m_peak_in_use, ++m_in_use);
+        return c;
     }
 
-    void print_stats() {
-        std::cout << "simulating: " << (is_server ? "server " : "client ") 
-                  << (sending ? "sending " : "receiving ") << std::endl;
-        std::cout << "settings: context_takeover=" << (context_takeover ? "true " : "false ")
-                  << "speed_level=" << speed_level
-                  << " window_bits=" << window_bits
-                  << " memory_level=" << memory_level
-                  << std::endl << std::endl;
-        
-        calc_stats();
-
-        std::cout << std::left << std::setw(32) <<  "Messages processed: " 
-                  << line_results.size() << std::endl;
-
-        std::cout << std::left << std::setw(32) << "Payload size (uncompressed): " 
-                  << double(total_payload)/1000.0 << "KB" << std::endl;
-
-        std::cout << std::left << std::setw(32) << "Payload size (compressed): " 
-                  << double(total_compressed_size)/1000.0 << "KB" << std::endl;
+    void release(zlib_context * c) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_free.push_back(c);
+            m_in_use--;
+        }
+        m_available.notify_one();
+    }
 
-        std::cout << std::left << std::setw(32) << "Frame overhead (uncompressed): " 
-                  << (double(total_frame_overhead) /
-                      double(total_payload + total_frame_overhead))*100.0 
-                  << "%" << std::endl;
+    context_list & contexts() {
+        return m_contexts;
+    }
 
-        std::cout << std::left << std::setw(32) << "Frame overhead (compressed): " 
-                  << (double(total_frame_overhead_compressed) / 
-                     double(total_compressed_size + total_frame_overhead_compressed))*100.0 
-                  << "%" << std::endl;
+    // most contexts in use at once
+    size_t peak_in_use() const {
+        return m_peak_in_use;
+    }
 
-        std::cout << std::left << std::setw(32) << "Total size (uncompressed): " 
-                  << double(total_payload+total_frame_overhead)/1000.0 << "KB" << std::endl;
+    // acquisitions that found the pool's lock held by another worker
+    size_t lock_contended() const {
+        return m_lock_contended;
+    }
+private:
+    context_list m_contexts;
+    std::vector<zlib_context *> m_free;
+    std::mutex m_mutex;
+    std::condition_variable m_available;
+    size_t m_in_use;
+    size_t m_peak_in_use;
+    size_t m_lock_contended;
+};
 
-        std::cout << std::left << std::setw(32) << "Total size (compressed): " 
-                  << double(total_compressed_size+total_frame_overhead_compressed)/1000.0 << "KB\n" 
-                  << std::endl;
+struct pool_result {
+    bool error = false;
+    size_t messages = 0;
+    size_t total_payload = 0;
+    size_t total_compressed_size = 0;
+    // acquisitions that found no free context, and the time spent waiting
+    size_t waits = 0;
+    double wait_seconds = 0;
+    size_t lock_contended = 0;
+    double reset_seconds = 0;
+    double deflate_seconds = 0;
+    size_t peak_in_use = 0;
+    // memory of every context in the pool, and of one of them
+    size_t pool_memory = 0;
+    size_t context_memory = 0;
+};
 
-        std::cout << std::left << std::setw(32) << "Payload compression ratio: " 
-                  << total_ratio << std::endl;
+// Simulate a server that sends without context takeover using a pool of
+// shared contexts. Worker threads take messages in order, acquire a context,
+// restore it to its initial state with deflateReset, or with deflateEnd and
+// deflateInit2 for reset_mode_reinit, compress the message and release the
+// context.
+pool_result pool_test(corpus const & input, test_result r, pool_settings const & ps, 
+    int reset_mode)
+{
+    pool_result result;
+    context_pool pool;
+    unsigned int workers = std::max(1u, ps.workers);
+    size_t size = (ps.contexts == 0 ? workers : ps.contexts);
 
-        std::cout << std::left << std::setw(32) << "Elapsed Time: " << total_elapsed_seconds*1000.0
-                  << "ms\n" << std::endl;
+    r.context_takeover = false;
+    if (!r.check_validity() || !pool.init(size, r)) {
+        result.error = true;
+        return result;
+    }
 
-        if (sending) {
-            double mem_score = ((1.0 - total_ratio)*100.0) / (double(mem_usage) / 1024.0);
+    std::atomic<size_t> next(0);
+    std::mutex result_mutex;
 
-            std::cout << "Memory used: " << double(mem_usage)/1024.0 << "KiB " 
-                      << (context_takeover ? "per connection" : "total") 
-                      << " for compression state." << std::endl;
-            std::cout << "Minimum memory required to decompress: " 
-                      << double(mem_usage_inflate_32)/1024.0 << "KiB (32 bit systems), "
-                      << double(mem_usage_inflate_64)/1024.0 << "KiB (64 bit systems)"
-                      << std::endl;
-            std::cout << "Memory efficiency score: " << mem_score << " % Compression per KiB of memory" << std::endl; 
-        } else {
-            std::cout << "Memory used: " << double(mem_usage)/1024.0 << "KiB " 
-                      << (context_takeover ? "per connection" : "total") 
-                      << " for decompression state." << std::endl;
+    // seconds between two clock readings, less the cost of reading the clock
+    auto interval = [](message_clock::ticks start, message_clock::ticks end) {
+        message_clock::ticks t = end - start;
+        return message_clock::to_seconds(
+            t > message_clock::overhead() ? t - message_clock::overhead() : 0);
+    };
 
-        }
-    }
-};
+    auto worker = [&]() {
+        pool_result w;
+        pod_buffer out_buf;
 
-// run a test
-test_result deflate_test(std::istream & input, test_result r) {
-    z_stream zlib_state;
-    const size_t buffer_size = 16384;
-    unsigned char buffer[buffer_size];
+        for (size_t i = next++; i < input.size(); i = next++) {
+            size_t payload_size = input.size(i);
+            w.messages++;
+            w.total_payload += payload_size;
+            if (payload_size == 0) {
+                w.total_compressed_size += 2;
+                continue;
+            }
 
-    pod_buffer out_buf;
+            bool waited;
+            message_clock::ticks t0 = message_clock::start();
+            zlib_context * context = pool.acquire(waited);
+            message_clock::ticks t1 = message_clock::stop();
 
-    if (!r.check_validity()) {
-        return r;
-    }
+            int ret = (reset_mode == reset_mode_reinit ? context->reinit(r) 
+                                                       : context->reset());
+            message_clock::ticks t2 = message_clock::stop();
 
-    int ret = deflateInit2(
-        &zlib_state,
-        r.speed_level,
-        Z_DEFLATED,
-        -1*r.window_bits,
-        r.memory_level,
-        Z_DEFAULT_STRATEGY
-    );
+            z_stream & zlib_state = context->stream();
+            zlib_state.avail_in = payload_size;
+            zlib_state.next_in = const_cast<unsigned char *>(input.data(i));
 
-    if (ret != Z_OK) {
-        std::cout << "Fatal Error setting up deflate context" << std::endl;
-        r.error = true;
-        return r;
+            out_buf.resize(deflateBound(&zlib_state,payload_size)+8);
+            out_buf.set_cursor(0);
+            zlib_state.avail_out = out_buf.avail();
+            zlib_state.next_out = out_buf.first_avail();
 
-    }
+            message_clock::ticks t3 = message_clock::start();
+            if (ret == Z_OK) {
+                ret = deflate(&zlib_state, Z_SYNC_FLUSH);
+            }
+            message_clock::ticks t4 = message_clock::stop();
 
-    int flush = (r.context_takeover ? Z_SYNC_FLUSH : Z_FULL_FLUSH);
+            out_buf.adv_cursor(out_buf.avail() - zlib_state.avail_out);
+            pool.release(context);
 
-    std::string line;
-    while (std::getline(input, line)) {
-        line_result lr;
-        lr.payload_size = line.size();
-        lr.frame_overhead = frame_overhead(!r.is_server,line.size());
+            if (ret != Z_OK || out_buf.avail() == 0) {
+                w.error = true;
+                break;
+            }
 
-        // compress
-        if (line.empty()) {
-            // compressed value will be 2 bytes
-            lr.compressed_size = 2;
-            lr.ratio = 2.0;
-            r.line_results.push_back(lr);
-            continue;
+            if (waited) {
+                w.waits++;
+                w.wait_seconds += interval(t0, t1);
+            }
+            w.reset_seconds += interval(t1, t2);
+            w.deflate_seconds += interval(t3, t4);
+            w.total_compressed_size += out_buf.cursor()-4;
         }
 
-        zlib_state.avail_in = line.size();
-        zlib_state.next_in = reinterpret_cast<unsigned char *>(const_cast<char *>(line.data()));
+        std::lock_guard<std::mutex> lock(result_mutex);
+        result.error = result.error || w.error;
+        result.messages += w.messages;
+        result.total_payload += w.total_payload;
+        result.total_compressed_size += w.total_compressed_size;
+        result.waits += w.waits;
+        result.wait_seconds += w.wait_seconds;
+        result.reset_seconds += w.reset_seconds;
+        result.deflate_seconds += w.deflate_seconds;
+    };
 
-        size_t est_size = deflateBound(&zlib_state,line.size());
-        out_buf.resize(est_size);
-        out_buf.set_cursor(0);
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < workers; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
 
-        zlib_state.avail_out = out_buf.avail();
-        zlib_state.next_out = out_buf.first_avail();
+    for (auto & t : threads) {
+        t.join();
+    }
 
-        std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
+    if (result.error) {
+        std::cout << "Fatal Error compressing a message from the context pool" << std::endl;
+    }
 
-        start = std::chrono::high_resolution_clock::now();
+    result.lock_contended = pool.lock_contended();
+    result.peak_in_use = pool.peak_in_use();
+    result.pool_memory = end_contexts(pool.contexts());
+    result.context_memory = pool.contexts()[0]->memory().steady;
+    return result;
+}
 
-        deflate(&zlib_state, flush);
+// Compare resetting and re-initializing pooled contexts, and the memory of a
+// pool with that of one context per connection. Returns false if a test failed.
+bool run_pool(corpus const & input, test_result const & r, pool_settings const & ps) {
+    unsigned int workers = std::max(1u, ps.workers);
+    size_t size = (ps.contexts == 0 ? workers : ps.contexts);
+    size_t connections = (r.connections > 0 ? r.connections 
+                                            : std::max<size_t>(1, input.connections()));
 
-        end = std::chrono::high_resolution_clock::now();
+    std::cout << "Context pool: " << size << " contexts shared by " << workers 
+              << " workers over " << connections << " connections" << std::endl << std::endl;
 
-        std::chrono::duration<double> elapsed_seconds = end-start;
-        lr.elapsed_seconds = elapsed_seconds.count();
+    std::cout << std::left << std::setw(14) << "reset" 
+              << std::setw(12) << "ratio"
+              << std::setw(10) << "waits"
+              << std::setw(12) << "wait(ms)"
+              << std::setw(12) << "locked"
+              << std::setw(14) << "reset(us)"
+              << std::setw(14) << "deflate(us)"
+              << std::setw(12) << "reset(%)"
+              << std::setw(12) << "pool(KiB)"
+              << std::endl;
 
-        out_buf.adv_cursor(out_buf.avail() - zlib_state.avail_out);
-        
-        if (out_buf.avail() == 0) {
-            std::cout << "Fatal Error, needed more memory than expected." << std::endl;
-            r.error = true;
-            return r;
+    int const modes[] = {reset_mode_reset, reset_mode_reinit};
+    pool_result results[2];
+    for (int m = 0; m < 2; m++) {
+        pool_result & p = results[m];
+        p = pool_test(input, r, ps, modes[m]);
+        if (p.error) {
+            return false;
         }
 
-        // we subtract 4 here because the final 4 byte trailer is the same on all compressed
-        // blocks and so it is implicitly omited by the permessage-deflate spec before writing
-        // on the wire and re-added by the other endpoint before inflation.
-        lr.compressed_size = out_buf.cursor()-4;
-        lr.frame_overhead_compressed = frame_overhead(!r.is_server,lr.compressed_size);
-
-        lr.ratio = double(lr.compressed_size) / double(lr.payload_size);
-        r.line_results.push_back(lr);
+        double messages = double(std::max<size_t>(1, p.messages));
+        std::cout << std::left << std::setw(14) << reset_mode_names[modes[m]]
+                  << std::setw(12) << double(p.total_compressed_size)/double(p.total_payload)
+                  << std::setw(10) << p.waits
+                  << std::setw(12) << p.wait_seconds*1000.0
+                  << std::setw(12) << p.lock_contended
+                  << std::setw(14) << p.reset_seconds*1000000.0/messages
+                  << std::setw(14) << p.deflate_seconds*1000000.0/messages
+                  << std::setw(12) << p.reset_seconds/(p.reset_seconds+p.deflate_seconds)*100.0
+                  << std::setw(12) << double(p.pool_memory)/1024.0
+                  << std::endl;
     }
 
-    return r;
+    pool_result const & p = results[0];
+    std::cout << std::endl << "Most contexts in use at once: " << p.peak_in_use << " of " 
+              << size << std::endl;
+    std::cout << "One context per connection: " << connections << " x " 
+              << double(p.context_memory)/1024.0 << "KiB = " 
+              << double(p.context_memory)*double(connections)/1024.0/1024.0 
+              << "MiB, the pool holds " << double(p.pool_memory)/1024.0/1024.0 << "MiB" 
+              << std::endl;
+    return true;
 }
 
 void print_help() {
     std::cout << "Usage: "
-              << "ws-pmce-stats [parameter1=val1, [parameter2=val2]]\n\n"
+              << "ws-pmce-stats [mode] [parameter1=val1, [parameter2=val2]]\n\n"
               << "Pass data in via standard input. ws-pmce-stats will simulate a WebSocket\n"
               << "connection using the parameters defined below. One line of input\n"
               << "represents one websocket message. Stats about the speed, memory usage,\n"
               << "and compression ratio will be printed at the end.\n\n"
+              << "Modes:\n"
+              << "  sweep\n"
+              << "    Test every combination of context_takeover, speed_level, window_bits\n"
+              << "    and memory_level on a pool of threads and print one row per\n"
+              << "    configuration. Each of these parameters may be given as a range\n"
+              << "    (speed_level=1-9), a list (window_bits=9,12,15) or, for\n"
+              << "    context_takeover, true,false. Parameters not given cover their full\n"
+              << "    range. strategy and connections may also be given as lists, and\n"
+              << "    strategy=all covers every strategy.\n\n"
+              << "  optimize\n"
+              << "    Run the same tests as sweep, print only the configurations on the\n"
+              << "    Pareto front of compressed size, CPU time per MB and context memory,\n"
+              << "    then choose the configuration with the smallest output that meets\n"
+              << "    the max_memory, max_p99 and max_cpu_per_mb constraints and print the\n"
+              << "    permessage-deflate parameters to negotiate for it.\n\n"
+              << "  convert\n"
+              << "    Write the input in the binary corpus format (to output= or standard\n"
+              << "    output) instead of testing it. Binary corpora hold messages of any\n"
+              << "    content, an opcode, a timestamp and a connection id per message and\n"
+              << "    are detected automatically when read.\n\n"
+              << "  lru\n"
+              << "    Compare context_budget values, from one context up to one per\n"
+              << "    connection, against keeping every connection's context. For each the\n"
+              << "    context hit rate, compression ratio and its degradation, and the time\n"
+              << "    spent setting contexts up again are printed.\n\n"
+              << "  hibernate\n"
+              << "    Compare idle thresholds for freeing deflate contexts against never\n"
+              << "    freeing them. Thresholds are idle_timeout values for input with\n"
+              << "    timestamps and idle_messages values otherwise. For each the extra\n"
+              << "    compressed bytes caused by losing the window are printed next to the\n"
+              << "    context memory held over time and the share of it saved.\n\n"
+              << "  pool\n"
+              << "    Simulate a server sending without context takeover from a pool of\n"
+              << "    pool_size contexts shared by workers threads. Each message takes a\n"
+              << "    context from the pool, restores it with deflateReset or by freeing it\n"
+              << "    and initializing it again, and is compressed. For both methods the\n"
+              << "    time workers waited for a free context, the reset and compression time\n"
+              << "    per message and the memory of the pool are printed, and the pool is\n"
+              << "    compared with one context for each of connections connections.\n\n"
+              << "  mask\n"
+              << "    Compare the byte at a time loop that masks a client's payloads with\n"
+              << "    the vectorized kernel used for frames=true and captures, over the\n"
+              << "    messages of the input grouped by size class. The time per message,\n"
+              << "    throughput and speedup of each are printed, from the median of\n"
+              << "    repeat passes.\n\n"
+              << "  policy\n"
+              << "    Compare policies that send some messages uncompressed, as a sender may\n"
+              << "    by leaving RSV1 unset, against compressing every message. Each\n"
+              << "    candidate min_size, max_entropy and max_ratio is run in turn on one\n"
+              << "    thread, taking the median of at least 5 runs after a warmup run, and\n"
+              << "    the CPU time it saves and the bytes it adds on the wire are printed.\n"
+              << "    The min_size that puts the fewest bytes on the wire is chosen, unless\n"
+              << "    wire_cost is set, in which case the one with the least CPU time in\n"
+              << "    total is chosen, counting wire_cost for every byte sent.\n\n"
+              << "  train-dictionary\n"
+              << "    Build a preset dictionary of up to dictionary_size bytes from a sample\n"
+              << "    of the input and write it to output= or standard output. Dictionaries\n"
+              << "    are trained with several segment sizes and the one that best\n"
+              << "    compresses the messages held out of the sample under the given\n"
+              << "    settings is kept. Use it with dictionary=.\n\n"
               << "Optional parameters: (usage key=val, in any combination, in any order)\n"
+              << "  file: [path]; Default standard input; \n"
+              << "    Read messages from a file instead. The file is memory mapped and\n"
+              << "    messages are compressed straight out of the mapping, which is much\n"
+              << "    faster for large captures.\n\n"
+              << "  output: [path]; Default standard output; \n"
+              << "    Where convert writes the binary corpus.\n\n"
+              << "  dictionary: [path]; Default none; \n"
+              << "    Preset dictionary that both endpoints load into every new context.\n"
+              << "    permessage-deflate has no parameter to negotiate one, so this only\n"
+              << "    applies between endpoints that agree on it out of band. Without\n"
+              << "    context takeover each message is compressed from a reset context with\n"
+              << "    the dictionary reloaded, and the cost of reloading it is timed.\n\n"
+              << "  dictionary_size: [8-32768]; Default 32768; \n"
+              << "    train-dictionary: largest dictionary to build. Only the last\n"
+              << "    2^window_bits bytes of a dictionary can be used.\n\n"
+              << "  fanout: [1...]; Default none; \n"
+              << "    Instead of a single test, model broadcasting every message to this many\n"
+              << "    subscribers. Compressing once without context takeover and sending the\n"
+              << "    same bytes to all is compared with compressing for each subscriber in\n"
+              << "    its own context: CPU per message, bytes on the wire and context memory\n"
+              << "    for up to this many subscribers, and the number of subscribers from\n"
+              << "    which shared compression uses less CPU. Up to 256 subscribers are\n"
+              << "    run with a live context each, so that the cost of their combined\n"
+              << "    working set is measured. CPU for more is extrapolated from the\n"
+              << "    largest run and marked as such.\n\n"
+              << "  wire_cost: [duration, e.g. 2ns]; Default 0; \n"
+              << "    fanout and policy: CPU time spent per byte sent, such as on TLS, to\n"
+              << "    include when finding the number of subscribers from which shared\n"
+              << "    compression is cheaper, or the min_size that costs least.\n\n"
+              << "  frames: [true,false]; Default false; \n"
+              << "    Write each message sent as a WebSocket frame, with a new masking key\n"
+              << "    and a masked copy of the payload when server=false, and time it as\n"
+              << "    part of sending. The time per message is broken down into deflate,\n"
+              << "    masking and header building. Sending only.\n\n"
+              << "  validate_utf8: [true,false]; Default false; \n"
+              << "    Check that every inflated text message is valid UTF-8, as a receiver\n"
+              << "    must, and time it as part of receiving. Runs of ASCII are skipped 16\n"
+              << "    bytes at a time and other bytes go through a lookup table automaton.\n"
+              << "    The time per message is broken down into inflate and validation, and\n"
+              << "    a byte at a time validator is timed on the same messages for\n"
+              << "    comparison. Receiving only.\n\n"
+              << "  max_frame_size: [bytes, e.g. 4096, 16KiB]; Default unlimited; \n"
+              << "    Largest frame payload. Longer messages are sent as continuation\n"
+              << "    frames. Compressed messages are deflated with Z_NO_FLUSH into a\n"
+              << "    buffer of one frame, which is sent each time it fills, and end with\n"
+              << "    the usual flush. The frames sent, the extra frame overhead, the time\n"
+              << "    to get each fragment ready, the time to the first fragment of each\n"
+              << "    message and the output buffer size are reported. Sending only, and\n"
+              << "    not with max_ratio.\n\n"
+              << "  histogram: [path]; Default none; \n"
+              << "    Write the distribution of time per message, in microseconds, in\n"
+              << "    HdrHistogram's percentile text format for plotting.\n\n"
+              << "  perf_counters: [true,false]; Default false; \n"
+              << "    Read hardware performance counters (cycles, instructions, L1d, LLC\n"
+              << "    and branch misses) around every timed deflate or inflate call and\n"
+              << "    report IPC and misses per KB. Per message counts are included in\n"
+              << "    dump. Linux only; perf_event_paranoid may need to be lowered.\n\n"
+              << "  repeat: [1...]; Default 1; \n"
+              << "    Number of times to run over the input, each with fresh contexts.\n"
+              << "    The mean, standard deviation and 95% confidence interval of the\n"
+              << "    throughput are reported and runs with high variance are flagged.\n"
+              << "    sweep and optimize show the mean and confidence interval.\n\n"
+              << "  warmup: [0...]; Default 0; \n"
+              << "    Number of runs over the input to discard before measuring.\n\n"
+              << "  dump: [path]; Default none; \n"
+              << "    Write the result of every message to a CSV file. Otherwise only\n"
+              << "    running totals and histograms of the results are kept, but memory\n"
+              << "    use still grows with the number of messages: the input is indexed\n"
+              << "    with 8 bytes per message for plain lines, 24 with a connection id\n"
+              << "    column and up to 33 for a binary corpus or a capture, which keep\n"
+              << "    each message's size and the opcode, timestamp and connection id they\n"
+              << "    have. Receiving (sending=false) also holds every compressed message,\n"
+              << "    plus 8 bytes each, as all messages are compressed before any is\n"
+              << "    inflated. Budget for these when replaying hundreds of millions of\n"
+              << "    messages.\n\n"
+              << "  pcap: [path]; Default none; \n"
+              << "    Replay WebSocket traffic from a libpcap capture file. TCP streams are\n"
+              << "    reassembled, frames are unmasked, compressed messages are inflated\n"
+              << "    and each TCP direction is tested with its own context. Only the\n"
+              << "    messages sent by the simulated compressing endpoint are used: the\n"
+              << "    server's for server=true sending=true, the client's for a receiving\n"
+              << "    server, and so on.\n\n"
               << "  server: [true,false]; Default true; \n"
               << "    Simulate a server (vs client). Affects frame overhead stats.\n\n"
               << "  sending: [true,false]; Default true; \n"
-              << "    Simulate sending (vs receiving). Affects memory usage stats.\n\n"
+              << "    Simulate sending (vs receiving). When receiving, the input is\n"
+              << "    compressed once up front and the time taken to inflate each\n"
+              << "    message is measured instead of the time taken to deflate it.\n"
+              << "    Also affects memory usage stats.\n\n"
               << "  context_takeover: [true,false]; Default true; \n"
               << "    Reuse compression context between messages. A value of false is\n"
               << "    equivilent to negotiating the permessage-deflate setting of \n"
               << "    *_no_context_takeover. If this value is true a separate compression\n"
               << "    context must be maintained for each connection. \n\n"
+              << "  reset_mode: [full_flush,deflateReset,reinit]; Default full_flush; \n"
+              << "    How messages are kept independent when context_takeover is false.\n"
+              << "    full_flush ends each message with Z_FULL_FLUSH on one long lived\n"
+              << "    stream. deflateReset restores the context with deflateReset (or\n"
+              << "    inflateReset) before each message, and reinit frees it and initializes\n"
+              << "    it again, allocation included. The reset time per message and its\n"
+              << "    share of the elapsed time are reported. With a dictionary, full_flush\n"
+              << "    is replaced by deflateReset.\n\n"
               << "  speed_level: [0...9]; Default 6; \n"
               << "    A tuning parameter that trades compression quality vs CPU usage.\n"
               << "    A value of 0 indicates no compression at all. This value may be\n"
@@ -369,17 +5237,83 @@ void print_help() {
               << "    Higher values use more memory but provide better compression. This\n"
               << "    value must be negotiated. A stream compressed with n bits can be\n"
               << "    decompressed only by an endpoint that uses at least that many. Not\n"
-              << "    all WebSocket endpoints will support negotiating this parameter.\n\n"
+              << "    all WebSocket endpoints will support negotiating this parameter.\n"
+              << "    zlib cannot produce raw deflate streams with an 8 bit window, so\n"
+              << "    a value of 8 is tested using a 9 bit window.\n\n"
               << "  memory_level: [1-9]; Default 8; \n"
               << "    A tuning parameter that trades compression quality vs memory usage.\n"
               << "    A value of 1 indicates lowest memory usage but worst compression. A\n"
               << "    value of 9 incidates most memory usage but best compression. This\n"
-              << "    parameter may be set unilaterally without negotiation."
+              << "    parameter may be set unilaterally without negotiation.\n\n"
+              << "  strategy: [default,filtered,huffman_only,rle,fixed]; Default default; \n"
+              << "    The zlib compression strategy. huffman_only skips string matching\n"
+              << "    entirely and rle only matches runs of the previous byte, both much\n"
+              << "    cheaper in CPU than the default at some cost in ratio. filtered\n"
+              << "    favours Huffman coding over short matches and fixed disables dynamic\n"
+              << "    Huffman trees. This parameter may be set unilaterally without\n"
+              << "    negotiation.\n\n"
+              << "  min_size: [0...]; Default 0; \n"
+              << "    Send messages smaller than this many bytes uncompressed.\n\n"
+              << "  max_entropy: [bits per byte, 0-8]; Default none; \n"
+              << "    Send messages whose byte entropy is above this uncompressed. The\n"
+              << "    estimate is timed as part of sending.\n\n"
+              << "  max_ratio: [ratio]; Default none; \n"
+              << "    Compress every message but send those that compress to a ratio above\n"
+              << "    this uncompressed instead. With context takeover the sender must copy\n"
+              << "    its context before each message to undo a rejected one, and the copy\n"
+              << "    is timed.\n\n"
+              << "  threads: [1...]; Default number of hardware threads; \n"
+              << "    Number of worker threads used by sweep and optimize.\n\n"
+              << "  connections: [0...]; Default 0; \n"
+              << "    Number of independent compression contexts to spread messages\n"
+              << "    across, simulating a server that switches between many connections.\n"
+              << "    0 means one context, or one per id with connection_id=column. The\n"
+              << "    combined memory of all contexts is compared to the CPU cache size.\n"
+              << "    sweep and optimize accept a range or list.\n\n"
+              << "  pool_size: [0...]; Default 0; \n"
+              << "    pool: number of shared contexts. 0 means one per worker.\n\n"
+              << "  workers: [1...]; Default number of hardware threads; \n"
+              << "    pool: number of worker threads compressing messages.\n\n"
+              << "  context_budget: [bytes, e.g. 64MiB, 2GiB]; Default unlimited; \n"
+              << "    Total memory for deflate contexts. As many contexts as fit are kept\n"
+              << "    for the most recently used connections. A connection whose context\n"
+              << "    was evicted gets a new one, with an empty window, on its next message\n"
+              << "    and the set up is timed. The hit rate and set up time are reported.\n"
+              << "    A connection's first context is set up untimed and not counted as a\n"
+              << "    miss, as every context is without a budget. Sending only.\n\n"
+              << "  idle_timeout: [duration, e.g. 500ms, 30s, 5min]; Default none; \n"
+              << "    Free a connection's deflate context once it has been unused for this\n"
+              << "    long, going by the timestamps in the input, and set it up again with\n"
+              << "    an empty window for the connection's next message. Needs a binary\n"
+              << "    corpus or capture with timestamps. Sending only.\n\n"
+              << "  idle_messages: [1...]; Default none; \n"
+              << "    As idle_timeout, with idle time counted in messages sent on any\n"
+              << "    connection.\n\n"
+              << "  connection_id: [round_robin,column]; Default round_robin; \n"
+              << "    How messages are assigned to connections. With column, each line\n"
+              << "    starts with a connection id and a tab, and a line without one is an\n"
+              << "    error. Binary corpora that contain connection ids always use them.\n\n"
+              << "  max_memory: [bytes, e.g. 65536, 64KiB, 1MiB]; Default unlimited; \n"
+              << "    optimize: largest acceptable measured context memory.\n\n"
+              << "  max_p99: [duration, e.g. 20us, 1ms]; Default unlimited; \n"
+              << "    optimize: largest acceptable 99th percentile time per message.\n\n"
+              << "  max_cpu_per_mb: [duration, e.g. 5ms]; Default unlimited; \n"
+              << "    optimize: largest acceptable CPU time per MB of payload."
               << std::endl;
 }
 
 int main(int argc, char * argv[]) {
     test_result r;
+    sweep_settings sweep;
+    optimize_settings constraints;
+    pool_settings pool;
+    std::string mode;
+    std::string input_file;
+    std::string output_file;
+    std::string pcap_file;
+    size_t dictionary_size = 32768;
+    size_t fanout = 0;
+    double wire_cost = 0;
 
     r.is_server = true;
     r.sending = true;
@@ -395,11 +5329,219 @@ int main(int argc, char * argv[]) {
             print_help();
             return 0;
         }
+
+        if (arg == "sweep" || arg == "optimize" || arg == "convert" 
+            || arg == "train-dictionary" || arg == "policy" || arg == "pool"
+            || arg == "hibernate" || arg == "lru" || arg == "mask")
+        {
+            mode = arg;
+            continue;
+        }
+        
+        if (arg.compare(0,5,"file=") == 0) {
+            input_file = arg.substr(5);
+            continue;
+        }
+        if (arg.compare(0,5,"pcap=") == 0) {
+            pcap_file = arg.substr(5);
+            continue;
+        }
+        if (arg.compare(0,7,"output=") == 0) {
+            output_file = arg.substr(7);
+            continue;
+        }
+        if (arg.compare(0,7,"fanout=") == 0) {
+            mode = "fanout";
+            fanout = std::max(1, atoi(arg.substr(7).c_str()));
+            continue;
+        }
+        if (arg.compare(0,10,"wire_cost=") == 0) {
+            wire_cost = parse_seconds(arg.substr(10));
+            continue;
+        }
+        if (arg.compare(0,16,"dictionary_size=") == 0) {
+            dictionary_size = std::min<size_t>(32768, 
+                std::max<size_t>(dictionary_dmer_size, atoi(arg.substr(16).c_str())));
+            continue;
+        }
         
         r.load_setting(arg);
+        sweep.load_setting(arg);
+        constraints.load_setting(arg);
+        pool.load_setting(arg);
+    }
+
+    if (!r.dictionary_file.empty()) {
+        std::ifstream in(r.dictionary_file.c_str(), std::ios::binary);
+        std::stringstream contents;
+        contents << in.rdbuf();
+        if (!in) {
+            std::cout << "Unable to read dictionary " << r.dictionary_file << std::endl;
+            return 1;
+        }
+        r.dictionary = std::make_shared<std::string const>(contents.str());
+    }
+
+    corpus input;
+    if (!pcap_file.empty()) {
+        // replay the messages sent by the endpoint doing the compressing
+        pcap_reader pcap(input, r.is_server == r.sending);
+        if (!pcap.read(pcap_file)) {
+            return 1;
+        }
+
+        pcap_reader::stats const & ps = pcap.get_stats();
+        if ((mode != "convert" && mode != "train-dictionary") || !output_file.empty()) {
+            std::cout << "pcap: " << ps.packets << " packets, " << ps.messages 
+                      << " messages recovered from " << ps.connections << " connections";
+            if (ps.inflate_errors || ps.protocol_errors) {
+                std::cout << " (" << ps.inflate_errors << " messages could not be inflated, " 
+                          << ps.protocol_errors << " framing errors)";
+            }
+            std::cout << std::endl;
+        }
+    } else if (input_file.empty() ? !input.load(std::cin, r.connection_id_column)
+                                  : !input.load_file(input_file, r.connection_id_column))
+    {
+        return 1;
+    }
+
+    // binary corpora carry their own connection ids
+    if (input.connections() > 0) {
+        r.connection_id_column = true;
+    }
+
+    if (mode == "convert") {
+        if (output_file.empty()) {
+            input.write_binary(std::cout);
+        } else {
+            std::ofstream out(output_file.c_str(), std::ios::binary);
+            input.write_binary(out);
+            if (!out) {
+                std::cout << "Unable to write " << output_file << std::endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    if (mode == "train-dictionary") {
+        // as with convert, the report is only printed when it would not end
+        // up mixed into the dictionary
+        std::string dictionary = train_dictionary(input, r, dictionary_size, 
+            !output_file.empty());
+        if (output_file.empty()) {
+            std::cout.write(dictionary.data(), dictionary.size());
+        } else {
+            std::ofstream out(output_file.c_str(), std::ios::binary);
+            out.write(dictionary.data(), dictionary.size());
+            if (!out) {
+                std::cout << "Unable to write " << output_file << std::endl;
+                return 1;
+            }
+        }
+        return (dictionary.empty() ? 1 : 0);
+    }
+
+    if (mode == "pool") {
+        std::cout << "simulating: " << (r.is_server ? "server " : "client ") 
+                  << "sending without context takeover" << std::endl;
+        std::cout << "Messages processed: " << input.size() << std::endl;
+        return (run_pool(input, r, pool) ? 0 : 1);
+    }
+
+    if (mode == "fanout") {
+        std::cout << "simulating: " << (r.is_server ? "server " : "client ") 
+                  << "broadcasting to " << fanout << " subscribers" << std::endl;
+        std::cout << "Messages processed: " << input.size() << std::endl;
+        return (run_fanout(input, r, fanout, wire_cost) ? 0 : 1);
+    }
+
+    if (mode == "mask") {
+        std::cout << "simulating: client masking" << std::endl;
+        std::cout << "Messages processed: " << input.size() << std::endl;
+        return (run_mask_benchmark(input, r) ? 0 : 1);
+    }
+
+    if (mode == "lru") {
+        std::cout << "simulating: " << (r.is_server ? "server " : "client ") 
+                  << "sending" << std::endl;
+        std::cout << "Messages processed: " << input.size() << std::endl;
+        return (run_lru(input, r, sweep.threads) ? 0 : 1);
+    }
+
+    if (mode == "hibernate") {
+        std::cout << "simulating: " << (r.is_server ? "server " : "client ") 
+                  << "sending" << std::endl;
+        std::cout << "Messages processed: " << input.size() << std::endl << std::endl;
+        return (run_hibernation(input, r, sweep.threads) ? 0 : 1);
+    }
+
+    if (mode == "policy") {
+        std::cout << "simulating: " << (r.is_server ? "server " : "client ") 
+                  << (r.sending ? "sending " : "receiving ") << std::endl;
+        std::cout << "Messages processed: " << input.size() << std::endl << std::endl;
+        return (run_policies(input, r, wire_cost) ? 0 : 1);
+    }
+
+    if (mode == "sweep" || mode == "optimize") {
+        std::chrono::time_point<std::chrono::steady_clock> start, end;
+        start = std::chrono::steady_clock::now();
+
+        std::vector<test_result> results = run_sweep(input, 
+            sweep.configurations(r), sweep.threads);
+
+        end = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed_seconds = end-start;
+
+        std::cout << "simulating: " << (r.is_server ? "server " : "client ") 
+                  << (r.sending ? "sending " : "receiving ") << std::endl;
+        std::cout << "Messages processed: " << input.size() << std::endl << std::endl;
+
+        std::vector<test_result> rows = results;
+        if (mode == "optimize") {
+            rows = pareto_front(results);
+            std::cout << "Pareto front of compressed size, CPU per MB and context memory: " 
+                      << rows.size() << " of " << results.size() << " configurations" 
+                      << std::endl << std::endl;
+        }
+
+        test_result::print_summary_header();
+        for (auto const & result : rows) {
+            result.print_summary_row();
+        }
+
+        std::cout << std::endl << "Swept " << results.size() << " configurations in " 
+                  << elapsed_seconds.count() << "s using " 
+                  << std::max(1u,sweep.threads) << " threads" << std::endl;
+
+        if (mode == "optimize") {
+            test_result const * best = choose_configuration(results, constraints);
+
+            std::cout << std::endl;
+            if (!best) {
+                std::cout << "No configuration satisfies the given constraints." << std::endl;
+                return 1;
+            }
+
+            std::cout << "Best configuration: " << std::endl;
+            test_result::print_summary_header();
+            best->print_summary_row();
+            std::cout << std::endl << "Negotiate: " << best->extension_offer() << std::endl;
+            // deflate parameters do not apply when receiving; the only local
+            // choice there is the window to inflate with
+            if (best->sending) {
+                std::cout << "Set locally: speed_level=" << best->speed_level 
+                          << " memory_level=" << best->memory_level 
+                          << " strategy=" << strategy_names[best->strategy] << std::endl;
+            } else {
+                std::cout << "Set locally: window_bits=" << best->window_bits << std::endl;
+            }
+        }
+        return 0;
     }
 
-    r = deflate_test(std::cin, r);
+    r = repeat_test(input, r);
 
     if (r.error) {
         std::cout << "Exited due to a fatal test error" << std::endl;
@@ -408,5 +5550,13 @@ int main(int argc, char * argv[]) {
 
     r.print_stats();
 
+    if (r.keep_messages && !r.write_dump()) {
+        return 1;
+    }
+
+    if (!r.histogram_file.empty() && !r.write_histogram()) {
+        return 1;
+    }
+
     return 0;
 }